@@ -66,7 +66,10 @@ void ioapicinit(void);
 
 // kalloc.c
 char *kalloc(void);
+char *kalloc_contig(int);
 void kfree(char *);
+void kfree_contig(char *, int);
+void kmemstat(uint *, uint *, uint *);
 void kinit1(void *, void *);
 void kinit2(void *, void *);
 
@@ -104,11 +107,13 @@ int pipewrite(struct pipe *, char *, int);
 
 // PAGEBREAK: 16
 // proc.c
+int cpuapicid(int);
 int cpuid(void);
 void exit(void);
 int fork(void);
 int growproc(int);
 int kill(int);
+int kthread(char *, void (*)(void *), void *);
 struct cpu *mycpu(void);
 struct proc *myproc();
 void pinit(void);
@@ -154,6 +159,7 @@ int argint(int, int *);
 int argptr(int, char **, int);
 int argstr(int, char **);
 int fetchint(uint, int *);
+int fetchptr(uint, int);
 int fetchstr(uint, char **);
 void syscall(void);
 
@@ -176,6 +182,7 @@ void seginit(void);
 void kvmalloc(void);
 pde_t *setupkvm(void);
 char *uva2ka(pde_t *, char *);
+char *uva2kva(char *);
 int allocuvm(pde_t *, uint, uint);
 int deallocuvm(pde_t *, uint, uint);
 void freevm(pde_t *);
@@ -0,0 +1,76 @@
+#include "types.h"
+#include "user.h"
+#include "net.h"
+
+const char *usage = "usage: ifconfig [interface address netmask]\n";
+
+// Parse the hexadecimal representation of an IPV4 address from its 'dot'
+// representation.
+uint parse_addr(char *addr) {
+  uint target_addr = 0x0;
+  uint shift = 24;
+  uint addr_len = strlen(addr);
+  for (int i = 0; i < addr_len; i++) {
+    char part[4] = {0x0, 0x0, 0x0, 0x0};
+    int sep = i;
+    for (int j = i; j < addr_len; j++) {
+      if (addr[j] == '.') {
+        sep = j;
+        break;
+      }
+      sep = j + 1; // No separator after last octet.
+    }
+    memmove(&part, addr + i, sep - i);
+
+    int octet = atoi(part);
+    target_addr |= octet << (shift);
+    shift -= 8;
+
+    i = sep;
+  }
+  return target_addr;
+}
+
+// Print an IPV4 address in its 'dot' representation.
+void print_addr(char *name, uint addr) {
+  printf(1, " %s %d.%d.%d.%d", name, addr >> 24, (addr >> 16) & 0xff,
+         (addr >> 8) & 0xff, addr & 0xff);
+}
+
+void print_interface(int index, struct ifconfig *c) {
+  printf(1, "net%d:", index);
+  print_addr("inet", c->address);
+  print_addr("netmask", c->netmask);
+  printf(1, " ether %x:%x:%x:%x:%x:%x\n", c->mac[0], c->mac[1], c->mac[2],
+         c->mac[3], c->mac[4], c->mac[5]);
+  printf(1, "  rx_packets %d tx_packets %d tx_dropped %d interrupts %d\n",
+         c->stats.rx_packets, c->stats.tx_packets, c->stats.tx_dropped,
+         c->stats.interrupts);
+}
+
+// Get or set the configuration of the network interfaces. With no arguments,
+// print every interface.
+int main(int argc, char *argv[]) {
+  struct ifconfig c;
+
+  if (argc == 1) {
+    for (int i = 0; ifconfig(i, &c, 0) == 0; i++)
+      print_interface(i, &c);
+    exit();
+  }
+
+  if (argc != 4) {
+    printf(2, usage);
+    exit();
+  }
+
+  int index = atoi(argv[1]);
+  c.address = parse_addr(argv[2]);
+  c.netmask = parse_addr(argv[3]);
+  if (ifconfig(index, &c, 1) < 0) {
+    printf(2, "ifconfig: no interface %d\n", index);
+    exit();
+  }
+  print_interface(index, &c);
+  exit();
+}
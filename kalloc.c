@@ -13,21 +13,99 @@ void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
                    // defined by the kernel linker script in kernel.ld
 
+// The most free pages a CPU caches. Pages move between a CPU
+// cache and the shared free list CACHE_BATCH at a time.
+#define CACHE_MAX 64
+#define CACHE_BATCH (CACHE_MAX / 2)
+
+// The number of physical pages, and the page number of the page
+// at kernel address v.
+#define NPAGE (PHYSTOP / PGSIZE)
+#define PGNUM(v) (V2P(v) / PGSIZE)
+
+// A free page. Pages on the shared free list are linked both ways
+// so kalloc_contig() can unlink any of them; the CPU caches only
+// use next.
 struct run {
   struct run *next;
+  struct run *prev;
+};
+
+// Free pages cached by a CPU, so most pages are allocated and
+// freed without taking kmem.lock. A cache is only touched by its
+// own CPU, with interrupts disabled. Pages cached by one CPU
+// cannot be allocated by another.
+struct kcache {
+  struct run *freelist;
+  int n;
 };
 
 struct {
   struct spinlock lock;
   int use_lock;
   struct run *freelist;
+  // The pages on freelist, one bit per physical page, so runs of
+  // free pages are found without walking the list.
+  uint freemap[NPAGE / 32];
+  struct kcache cache[NCPU];
+  // Counters, protected by lock.
+  uint refills;   // CPU caches refilled from freelist
+  uint drains;    // CPU caches drained to freelist
+  uint contended; // Acquisitions of lock that had to wait
 } kmem;
 
+// Acquire kmem.lock, counting acquisitions that find it held.
+static void kmemlock(void) {
+  int busy = kmem.lock.locked;
+
+  acquire(&kmem.lock);
+  if (busy)
+    kmem.contended++;
+}
+
+// Record whether page r is on the shared free list.
+static void kmark(struct run *r, int free) {
+  if (free)
+    kmem.freemap[PGNUM(r) / 32] |= 1U << (PGNUM(r) % 32);
+  else
+    kmem.freemap[PGNUM(r) / 32] &= ~(1U << (PGNUM(r) % 32));
+}
+
+// Splice the chain of pages from head to tail onto the front of
+// the shared free list, keeping its order.
+static void ksplice(struct run *head, struct run *tail) {
+  struct run *r;
+
+  head->prev = 0;
+  for (r = head; r != tail; r = r->next) {
+    r->next->prev = r;
+    kmark(r, 1);
+  }
+  kmark(tail, 1);
+  tail->next = kmem.freelist;
+  if (tail->next)
+    tail->next->prev = tail;
+  kmem.freelist = head;
+}
+
+// Unlink page r from the shared free list.
+static void kunlink(struct run *r) {
+  if (r->prev)
+    r->prev->next = r->next;
+  else
+    kmem.freelist = r->next;
+  if (r->next)
+    r->next->prev = r->prev;
+  kmark(r, 0);
+}
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
 // 2. main() calls kinit2() with the rest of the physical pages
 // after installing a full page table that maps them on all cores.
+// The CPU caches are only used once the lock is, after every CPU
+// has been found.
 void kinit1(void *vstart, void *vend) {
   initlock(&kmem.lock, "kmem");
   kmem.use_lock = 0;
@@ -45,41 +123,168 @@ void freerange(void *vstart, void *vend) {
   for (; p + PGSIZE <= (char *)vend; p += PGSIZE)
     kfree(p);
 }
+// Check a page about to be freed and fill it with junk to
+// catch dangling refs.
+static struct run *junk(char *v) {
+  if ((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kfree");
+
+  memset(v, 1, PGSIZE);
+  return (struct run *)v;
+}
+
 // PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page goes to the cache of this CPU, which is drained
+// to the shared free list when it overflows.
 void kfree(char *v) {
-  struct run *r;
+  struct kcache *c;
+  struct run *r, *head;
+  int i;
 
-  if ((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
-    panic("kfree");
-
-  // Fill with junk to catch dangling refs.
-  memset(v, 1, PGSIZE);
+  r = junk(v);
+  if (!kmem.use_lock) {
+    ksplice(r, r);
+    return;
+  }
 
-  if (kmem.use_lock)
-    acquire(&kmem.lock);
-  r = (struct run *)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if (kmem.use_lock)
+  pushcli();
+  c = &kmem.cache[cpuid()];
+  r->next = c->freelist;
+  c->freelist = r;
+  if (++c->n > CACHE_MAX) {
+    // Move the batch at the head of the cache over, keeping its
+    // order.
+    head = c->freelist;
+    for (r = head, i = 1; i < CACHE_BATCH; i++)
+      r = r->next;
+    c->freelist = r->next;
+    c->n -= CACHE_BATCH;
+    kmemlock();
+    ksplice(head, r);
+    kmem.drains++;
     release(&kmem.lock);
+  }
+  popcli();
 }
 
 // Allocate one 4096-byte page of physical memory.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
+// The page comes from the cache of this CPU, which is refilled
+// from the shared free list when it is empty.
 char *kalloc(void) {
+  struct kcache *c;
   struct run *r;
+  int n;
+
+  if (!kmem.use_lock) {
+    r = kmem.freelist;
+    if (r)
+      kunlink(r);
+    return (char *)r;
+  }
+
+  pushcli();
+  c = &kmem.cache[cpuid()];
+  if (c->n == 0) {
+    // Take the batch at the head of the shared list as one chain,
+    // keeping its order.
+    kmemlock();
+    r = kmem.freelist;
+    if (r) {
+      kmark(r, 0);
+      for (n = 1; n < CACHE_BATCH && r->next; n++) {
+        r = r->next;
+        kmark(r, 0);
+      }
+      c->freelist = kmem.freelist;
+      c->n = n;
+      kmem.freelist = r->next;
+      if (r->next)
+        r->next->prev = 0;
+      r->next = 0;
+    }
+    kmem.refills++;
+    release(&kmem.lock);
+  }
+  r = c->freelist;
+  if (r) {
+    c->freelist = r->next;
+    c->n--;
+  }
+  popcli();
+  return (char *)r;
+}
+
+// Allocate n physically contiguous pages.
+// Returns a pointer to the lowest page, or 0 if no run of n free
+// pages is found on the shared free list. Runs are found in the
+// free page bitmap, whatever the order of the list, skipping
+// whole words of allocated or free pages at a time.
+char *kalloc_contig(int n) {
+  uint i, w, len;
+  char *v;
+  int j;
+
+  if (n <= 0)
+    return 0;
 
   if (kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
-  if (r)
-    kmem.freelist = r->next;
+    kmemlock();
+  v = 0;
+  len = 0;
+  for (i = 0; i < NPAGE && len < n;) {
+    w = kmem.freemap[i / 32];
+    if (i % 32 == 0 && (w == 0 || w == ~0)) {
+      len = w ? len + 32 : 0;
+      i += 32;
+    } else {
+      len = (w >> (i % 32)) & 1 ? len + 1 : 0;
+      i++;
+    }
+  }
+  if (len >= n) {
+    v = P2V((i - len) * PGSIZE);
+    for (j = 0; j < n; j++)
+      kunlink((struct run *)(v + j * PGSIZE));
+  }
   if (kmem.use_lock)
     release(&kmem.lock);
-  return (char *)r;
+  return v;
+}
+
+// Free n physically contiguous pages starting at v, which
+// normally should have been returned by kalloc_contig(n).
+// The pages bypass the CPU caches, so the run is free again
+// for the next kalloc_contig().
+void kfree_contig(char *v, int n) {
+  int i;
+
+  if (n <= 0)
+    return;
+  for (i = 0; i < n; i++) {
+    junk(v + i * PGSIZE);
+    ((struct run *)(v + i * PGSIZE))->next = (struct run *)(v + (i + 1) * PGSIZE);
+  }
+
+  if (kmem.use_lock)
+    kmemlock();
+  ksplice((struct run *)v, (struct run *)(v + (n - 1) * PGSIZE));
+  if (kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Report how often the CPU caches were refilled from and
+// drained to the shared free list, and how often taking its
+// lock had to wait for another CPU.
+void kmemstat(uint *refills, uint *drains, uint *contended) {
+  acquire(&kmem.lock);
+  *refills = kmem.refills;
+  *drains = kmem.drains;
+  *contended = kmem.contended;
+  release(&kmem.lock);
 }
@@ -12,6 +12,7 @@ extern pde_t *kpgdir;
 extern char end[]; // first address after kernel loaded from ELF file
 
 extern void rustnetinit();
+extern void rustnetstart();
 
 // Bootstrap processor starts running C code here.
 // Allocate a real stack and switch to it, first
@@ -35,6 +36,7 @@ int main(void) {
   kinit2(P2V(4 * 1024 * 1024), P2V(PHYSTOP)); // must come after startothers()
   rustnetinit();                              // network stack
   userinit();                                 // first user process
+  rustnetstart();                             // network threads
   mpmain();                                   // finish this processor's setup
 }
 
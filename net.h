@@ -0,0 +1,61 @@
+// A message for the sendmmsg system call.
+struct mmsg {
+  const void *buf; // Message data
+  int len;         // Length of message data in bytes
+};
+
+// Network device parameters for the netctl system call.
+#define NETCTL_ITR 1     // Minimum interval between interrupts (256ns units)
+#define NETCTL_RDTR 2    // Receive interrupt delay (1.024us units)
+#define NETCTL_RADV 3    // Maximum receive interrupt delay (1.024us units)
+#define NETCTL_MTU 4     // Largest frame payload (bytes)
+#define NETCTL_PROMISC 5 // Receive frames for other hosts (0 or 1)
+#define NETCTL_RXRING 6  // Receive descriptors (multiple of 8, up to 4096)
+#define NETCTL_TXRING 7  // Transmit descriptors (multiple of 8, up to 4096)
+
+// Network stack counters reported by the netstat system call.
+struct netstat {
+  uint interrupts;  // Device interrupts handled
+  uint rx_packets;  // Frames received
+  uint tx_packets;  // Frames sent
+  uint tx_dropped;  // Replies dropped for lack of transmit descriptors
+  uint rx_overruns; // Receiver overruns, where the receive ring was full
+  uint rx_missed;   // Frames lost for lack of receive descriptors
+  // Packet buffer pool, system wide and only reported by netstat().
+  uint pool_buffers; // Buffers in the pool
+  uint pool_in_use;  // Buffers in use
+  uint pool_misses;  // Times the pool ran dry and grew
+  // Page allocator, system wide and only reported by netstat().
+  uint kmem_refills;   // CPU page caches refilled from the shared list
+  uint kmem_drains;    // CPU page caches drained to the shared list
+  uint kmem_contended; // Shared list lock acquisitions that had to wait
+};
+
+// Network interface configuration for the ifconfig system call.
+struct ifconfig {
+  uint address;         // Protocol (IP) address, host byte order
+  uint netmask;         // Netmask, host byte order
+  uchar mac[6];         // Hardware (MAC) address
+  struct netstat stats; // Network stack counters of the interface
+};
+
+// Network device statistics reported by the netdevstat system call.
+struct netdevstat {
+  uint64 rx_packets;      // Frames received, including bad frames
+  uint64 rx_good_packets; // Good frames received
+  uint64 rx_broadcast;    // Good broadcast frames received
+  uint64 rx_multicast;    // Good multicast frames received
+  uint64 rx_bytes;        // Bytes received, including bad frames
+  uint64 rx_good_bytes;   // Bytes received in good frames
+  uint64 rx_crc_errors;   // Frames received with a CRC error
+  uint64 rx_errors;       // Frames received with another receive error
+  uint64 rx_missed;       // Frames dropped because the receive FIFO was full
+  uint64 rx_no_buffers;   // Frames arriving with no free receive descriptor
+  uint64 rx_undersize;    // Frames received shorter than the minimum size
+  uint64 rx_oversize;     // Frames received longer than the maximum size
+  uint64 tx_packets;      // Frames sent, including failed frames
+  uint64 tx_good_packets; // Frames sent successfully
+  uint64 tx_bytes;        // Bytes sent, including failed frames
+  uint64 tx_good_bytes;   // Bytes sent in successful frames
+  uint64 collisions;      // Collisions seen while sending
+};
@@ -0,0 +1,9 @@
+#include "types.h"
+#include "user.h"
+
+// Run the kernel network stack micro-benchmarks. Results are reported on
+// the console.
+int main(int argc, char *argv[]) {
+  netbench();
+  exit();
+}
@@ -0,0 +1,79 @@
+#include "types.h"
+#include "user.h"
+#include "net.h"
+
+#define NPARAMS (sizeof(params) / sizeof(params[0]))
+
+const char *usage = "usage: netctl [itr|rdtr|radv|mtu|promisc|rxring|txring] [value]\n";
+
+struct param {
+  char *name;
+  int id;
+};
+
+struct param params[] = {
+    {"itr", NETCTL_ITR},
+    {"rdtr", NETCTL_RDTR},
+    {"radv", NETCTL_RADV},
+    {"mtu", NETCTL_MTU},
+    {"promisc", NETCTL_PROMISC},
+    {"rxring", NETCTL_RXRING},
+    {"txring", NETCTL_TXRING},
+};
+
+// Print the interrupt, packet and drop rates over one second.
+void rates(void) {
+  struct netstat before, after;
+  int start, elapsed;
+
+  start = uptime();
+  netstat(&before);
+  sleep(100);
+  netstat(&after);
+  elapsed = uptime() - start;
+  if (elapsed <= 0)
+    elapsed = 1;
+
+  uint interrupts = after.interrupts - before.interrupts;
+  uint packets = after.rx_packets - before.rx_packets;
+  printf(1, "interrupts/s %d\n", interrupts * 100 / elapsed);
+  printf(1, "packets/s %d\n", packets * 100 / elapsed);
+  if (interrupts > 0)
+    printf(1, "packets/interrupt %d\n", packets / interrupts);
+  else
+    printf(1, "packets/interrupt 0\n");
+  printf(1, "overruns/s %d\n",
+         (after.rx_overruns - before.rx_overruns) * 100 / elapsed);
+  printf(1, "missed/s %d\n", (after.rx_missed - before.rx_missed) * 100 / elapsed);
+}
+
+// Get or set network device parameters. With no arguments, print all of the
+// parameters followed by the current interrupt rates.
+int main(int argc, char *argv[]) {
+  int i;
+
+  if (argc == 1) {
+    for (i = 0; i < NPARAMS; i++)
+      printf(1, "%s %d\n", params[i].name, netctl(params[i].id, -1));
+    rates();
+    exit();
+  }
+
+  for (i = 0; i < NPARAMS; i++) {
+    if (strcmp(argv[1], params[i].name) == 0)
+      break;
+  }
+  if (i == NPARAMS || argc > 3) {
+    printf(2, usage);
+    exit();
+  }
+
+  int value = argc == 3 ? atoi(argv[2]) : -1;
+  int result = netctl(params[i].id, value);
+  if (result < 0) {
+    printf(2, "netctl: cannot set %s\n", params[i].name);
+    exit();
+  }
+  printf(1, "%s %d\n", params[i].name, result);
+  exit();
+}
@@ -0,0 +1,72 @@
+#include "types.h"
+#include "user.h"
+#include "net.h"
+
+// Print a 64 bit value in decimal. The division is done 16 bits at a time,
+// as user programs are not linked with the compiler's 64 bit division.
+void printu64(char *name, uint64 x) {
+  char buf[21];
+  int i = sizeof(buf) - 1;
+  uint hi = x >> 32, lo = x, mid, low, r;
+
+  buf[i] = 0;
+  do {
+    r = hi % 10;
+    hi /= 10;
+    mid = (r << 16) | (lo >> 16);
+    r = mid % 10;
+    mid /= 10;
+    low = (r << 16) | (lo & 0xffff);
+    r = low % 10;
+    low /= 10;
+    lo = (mid << 16) | low;
+    buf[--i] = '0' + r;
+  } while (hi || lo);
+  printf(1, "%s %s\n", name, buf + i);
+}
+
+// Print the network stack counters followed by the device statistics, so
+// drops can be told apart by where they happened.
+int main(int argc, char *argv[]) {
+  struct netstat s;
+  struct netdevstat d;
+
+  if (netstat(&s) < 0 || netdevstat(&d) < 0) {
+    printf(2, "netstat: cannot read statistics\n");
+    exit();
+  }
+
+  printf(1, "stack:\n");
+  printf(1, "interrupts %d\n", s.interrupts);
+  printf(1, "rx_packets %d\n", s.rx_packets);
+  printf(1, "tx_packets %d\n", s.tx_packets);
+  printf(1, "tx_dropped %d\n", s.tx_dropped);
+  printf(1, "rx_overruns %d\n", s.rx_overruns);
+  printf(1, "rx_missed %d\n", s.rx_missed);
+  printf(1, "pool_buffers %d\n", s.pool_buffers);
+  printf(1, "pool_in_use %d\n", s.pool_in_use);
+  printf(1, "pool_misses %d\n", s.pool_misses);
+  printf(1, "kmem_refills %d\n", s.kmem_refills);
+  printf(1, "kmem_drains %d\n", s.kmem_drains);
+  printf(1, "kmem_contended %d\n", s.kmem_contended);
+
+  printf(1, "device:\n");
+  printu64("rx_packets", d.rx_packets);
+  printu64("rx_good_packets", d.rx_good_packets);
+  printu64("rx_broadcast", d.rx_broadcast);
+  printu64("rx_multicast", d.rx_multicast);
+  printu64("rx_bytes", d.rx_bytes);
+  printu64("rx_good_bytes", d.rx_good_bytes);
+  printu64("rx_crc_errors", d.rx_crc_errors);
+  printu64("rx_errors", d.rx_errors);
+  printu64("rx_missed", d.rx_missed);
+  printu64("rx_no_buffers", d.rx_no_buffers);
+  printu64("rx_undersize", d.rx_undersize);
+  printu64("rx_oversize", d.rx_oversize);
+  printu64("tx_packets", d.tx_packets);
+  printu64("tx_good_packets", d.tx_good_packets);
+  printu64("tx_bytes", d.tx_bytes);
+  printu64("tx_good_bytes", d.tx_good_bytes);
+  printu64("collisions", d.collisions);
+  exit();
+}
@@ -25,6 +25,9 @@ void pinit(void) { initlock(&ptable.lock, "ptable"); }
 // Must be called with interrupts disabled
 int cpuid() { return mycpu() - cpus; }
 
+// Local APIC ID of the nth CPU, wrapping around if there are fewer CPUs.
+int cpuapicid(int n) { return cpus[n % ncpu].apicid; }
+
 // Must be called with interrupts disabled to avoid the caller being
 // rescheduled between reading lapicid and running through the loop.
 struct cpu *mycpu(void) {
@@ -139,6 +142,59 @@ void userinit(void) {
   release(&ptable.lock);
 }
 
+// Kernel threads must never return from their entry function.
+static void kthreadexit(void) { panic("kthread returned"); }
+
+// A kernel thread's very first scheduling by scheduler()
+// will swtch here. Unlike forkret, it leaves the one-time
+// file system setup to the first user process.
+static void kthreadret(void) {
+  // Still holding ptable.lock from scheduler.
+  release(&ptable.lock);
+
+  // Return to "caller", actually fn (see kthread).
+}
+
+// Create a kernel thread that runs fn(arg) in its own process.
+// The thread shares the kernel address space, has no user memory
+// and no open files, and never returns to user space.
+// Return its pid, or -1 on failure.
+int kthread(char *name, void (*fn)(void *), void *arg) {
+  struct proc *p;
+  uint *sp;
+
+  if ((p = allocproc()) == 0)
+    return -1;
+  if ((p->pgdir = setupkvm()) == 0) {
+    kfree(p->kstack);
+    p->kstack = 0;
+    p->state = UNUSED;
+    return -1;
+  }
+  p->sz = 0;
+  p->parent = initproc;
+
+  // Start at kthreadret rather than forkret, and make it
+  // "return" into fn instead of trapret. The trap frame is
+  // unused, so its space holds fn's return address and
+  // argument, as if fn had been called.
+  p->context->eip = (uint)kthreadret;
+  sp = (uint *)p->tf;
+  sp[-1] = (uint)fn;
+  sp[0] = (uint)kthreadexit;
+  sp[1] = (uint)arg;
+
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+
+  p->state = RUNNABLE;
+
+  release(&ptable.lock);
+
+  return p->pid;
+}
+
 // Grow current process's memory by n bytes.
 // Return 0 on success, -1 on failure.
 int growproc(int n) {
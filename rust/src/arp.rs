@@ -3,7 +3,7 @@ use alloc::collections::BTreeMap;
 
 use crate::ethernet::{EthernetAddress, EthernetFrame, Ethertype};
 use crate::ip::Ipv4Addr;
-use crate::net::NetworkDevice;
+use crate::net::{NetworkDevice, TxError};
 use crate::packet_buffer::{FromBuffer, PacketBuffer, ToBuffer, BUFFER_SIZE};
 
 const ARP_PACKET_SIZE: usize = 28;
@@ -34,8 +34,13 @@ impl ArpCache {
         }
     }
 
-    /// Send a request to resolve a hardware address.
-    pub fn resolve(protocol_address: &Ipv4Addr, device: &mut Box<dyn NetworkDevice>) {
+    /// Send a request to resolve a hardware address, from the device with
+    /// the protocol address `source`.
+    pub fn resolve(
+        protocol_address: &Ipv4Addr,
+        source: Ipv4Addr,
+        device: &mut Box<dyn NetworkDevice>,
+    ) -> Result<(), TxError> {
         let mut packet_buffer = PacketBuffer::new(BUFFER_SIZE);
 
         let broadcast_hardware_address =
@@ -47,7 +52,7 @@ impl ArpCache {
             plen: 4,
             oper: Operation::Request,
             sha: device.hardware_address(),
-            spa: device.protocol_address(),
+            spa: source,
             tha: broadcast_hardware_address,
             tpa: *protocol_address,
         };
@@ -60,7 +65,7 @@ impl ArpCache {
         );
         packet_buffer.serialize(&ethernet_frame);
 
-        device.send(packet_buffer);
+        device.send(packet_buffer)
     }
 }
 
@@ -178,8 +183,8 @@ impl ArpPacket {
     }
 }
 
-impl FromBuffer for ArpPacket {
-    fn from_buffer(buf: &[u8]) -> Result<ArpPacket, ()> {
+impl<'a> FromBuffer<'a> for ArpPacket {
+    fn from_buffer(buf: &'a [u8]) -> Result<ArpPacket, ()> {
         Ok(ArpPacket::from_slice(&buf))
     }
 
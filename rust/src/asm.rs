@@ -13,3 +13,27 @@ pub unsafe fn in_dw(port: u16) -> u32 {
     asm!("in eax, dx", in("dx")port, out("eax")result);
     result
 }
+
+/// Output a word to the port specified by `port`.
+pub unsafe fn out_w(port: u16, data: u16) {
+    asm!("out dx, ax", in("dx")port, in("ax")data);
+}
+
+/// Read a word from the port specified by `port`.
+pub unsafe fn in_w(port: u16) -> u16 {
+    let mut result: u16;
+    asm!("in ax, dx", in("dx")port, out("ax")result);
+    result
+}
+
+/// Output a byte to the port specified by `port`.
+pub unsafe fn out_b(port: u16, data: u8) {
+    asm!("out dx, al", in("dx")port, in("al")data);
+}
+
+/// Read a byte from the port specified by `port`.
+pub unsafe fn in_b(port: u16) -> u8 {
+    let mut result: u8;
+    asm!("in al, dx", in("dx")port, out("al")result);
+    result
+}
@@ -0,0 +1,63 @@
+///
+/// Network stack micro-benchmarks.
+///
+/// Benchmarks are run on demand by the netbench system call and report the
+/// average number of cycles spent per packet on the console.
+use crate::cpu::rdtsc;
+use crate::e1000::{rx_half_alloc, rx_half_release};
+use crate::ethernet::EthernetFrame;
+use crate::kernel::{cprintf, popcli, pushcli};
+use crate::packet_buffer::PacketBuffer;
+
+/// The number of packets processed by each benchmark.
+const ITERATIONS: u64 = 10_000;
+
+/// The size of the synthetic frame, a full size ethernet frame without FCS.
+const FRAME_SIZE: usize = 1514;
+
+/// The netbench system call.
+#[no_mangle]
+unsafe extern "C" fn sys_netbench() -> i32 {
+    // Build a broadcast ARP frame header in a receive buffer.
+    let frame = rx_half_alloc();
+    core::ptr::write_bytes(frame, 0xFF, 12);
+    *frame.add(12) = 0x08;
+    *frame.add(13) = 0x06;
+
+    pushcli();
+    let copy = bench_rx_copy(frame);
+    let loan = bench_rx_loan(frame);
+    popcli();
+
+    cprintf(b"netbench: rx copy %d cycles/packet\n\x00".as_ptr(), copy);
+    cprintf(b"netbench: rx loan %d cycles/packet\n\x00".as_ptr(), loan);
+    0
+}
+
+/// Receive by copying each frame out of the descriptor buffer.
+fn bench_rx_copy(frame: *mut u8) -> u32 {
+    let start = rdtsc();
+    for _ in 0..ITERATIONS {
+        let buf = PacketBuffer::new_from_bytes(frame, FRAME_SIZE);
+        let _ = buf.parse::<EthernetFrame>();
+    }
+    ((rdtsc() - start) / ITERATIONS) as u32
+}
+
+/// Receive by loaning each descriptor buffer to the stack, as E1000::recv
+/// does. Consumes `frame`.
+fn bench_rx_loan(frame: *mut u8) -> u32 {
+    let mut page = frame;
+    let start = rdtsc();
+    for _ in 0..ITERATIONS {
+        // Swap a spare buffer into the "ring" and loan out the filled one.
+        let spare = rx_half_alloc();
+        let buf = unsafe { PacketBuffer::new_loaned(page, FRAME_SIZE, rx_half_release) };
+        let _ = buf.parse::<EthernetFrame>();
+        drop(buf);
+        page = spare;
+    }
+    let cycles = ((rdtsc() - start) / ITERATIONS) as u32;
+    rx_half_release(page);
+    cycles
+}
@@ -1,29 +1,109 @@
 use alloc::vec;
 use alloc::vec::Vec;
+use core::sync::atomic::{AtomicBool, Ordering};
 
-use crate::ethernet::EthernetAddress;
-use crate::ip::Ipv4Addr;
-use crate::kernel::{ioapicenable, kalloc};
-use crate::mm::{PhysicalAddress, VirtualAddress, PAGE_SIZE};
-use crate::net::NetworkDevice;
-use crate::packet_buffer::PacketBuffer;
+use crate::cpu::{rdtsc, CPU_FREQ_MHZ};
+use crate::ethernet::{EthernetAddress, DEFAULT_MTU, HEADER_LEN, MAX_MTU, MIN_MTU};
+use crate::kernel::{cpuapicid, ioapicenable, kalloc, kfree, ticks};
+use crate::mm::{ContiguousArray, FreeList, PhysicalAddress, PAGE_SIZE};
+use crate::net::{
+    DeviceParameter, DeviceStats, InterruptStatus, NetworkDevice, Offload, TxError, TxFragment,
+    MAX_QUEUES,
+};
+use crate::packet_buffer::{ChecksumStatus, PacketBuffer, RxChecksum, TxChecksum};
 use crate::pci::PciConfig;
+use crate::spinlock::Spinlock;
 
 const IRQ_PIC0: u32 = 0xB;
 
+/// The interrupt vector raised by a single MSI message, the vector of the
+/// legacy interrupt (T_IRQ0 + IRQ_PCI0 in traps.h) so it reaches netintr().
+const MSI_VECTOR: u8 = 32 + IRQ_PIC0 as u8;
+
+/// The interrupt vector raised by the first MSI-X table entry, T_IRQ0 +
+/// IRQ_MSI0 in traps.h. The queue pairs take the first vectors, followed by
+/// the vector for other causes.
+const MSIX_VECTOR0: u8 = 32 + 24;
+
+/// Set once a device has claimed the MSI-X vectors.
+static MSIX_CLAIMED: AtomicBool = AtomicBool::new(false);
+
 const EEPROM_DONE: u32 = 0x00000010;
 
+/// The default minimum interval between interrupts, in 256ns units. Limits
+/// the device to roughly 6000 interrupts per second.
+const DEFAULT_ITR: u32 = 651;
+
+/// How often the statistics registers are folded into the software totals,
+/// in timer ticks. The 32 bit counters cannot wrap this quickly.
+const STATS_INTERVAL: u32 = 100;
+
+/// How long to wait, in microseconds, for the device to send the frames in
+/// flight on a transmit ring before giving up on it, as when the link is
+/// down.
+const TX_DRAIN_TIMEOUT_US: u64 = 100_000;
+
+/// The number of receive and transmit descriptors set up at boot.
+const DEFAULT_RX_RING_SIZE: usize = 512;
+const DEFAULT_TX_RING_SIZE: usize = 256;
+
+/// The largest ring the device supports, 64 KiB of descriptors. Ring lengths
+/// must be a multiple of 128 bytes, or 8 descriptors.
+const MAX_RING_SIZE: usize = 4096;
+
+/// The receive buffer size used while frames at the MTU fit in it. Two of
+/// these buffers are packed into each page.
+pub const RX_HALF_SIZE: usize = PAGE_SIZE / 2;
+
+/// The maximum number of spare receive buffer pages kept for reuse. Up to
+/// twice as many half page buffers are kept.
+const RX_POOL_MAX: usize = 256;
+
+/// Spare receive buffers.
+///
+/// Received frames are loaned to the network stack in the buffer the device
+/// wrote them to, and a spare buffer from this pool is swapped into the
+/// descriptor. When the stack drops the frame its buffer is returned here.
+static RX_POOL: Spinlock<RxBufferPool> = Spinlock::new(RxBufferPool::new());
+
+/// The offset between the registers of consecutive receive or transmit
+/// queues.
+const QUEUE_REGISTER_STRIDE: u32 = 0x100;
+
+/// The RSS hash key. Any key spreads flows across the queues; this is the
+/// one used in the Microsoft RSS verification suite.
+const RSS_KEY: [u32; 10] = [
+    0xDA565A6D, 0xC20E5B25, 0x3D256741, 0xB08FA343, 0xCB2BCAD0, 0xB4307BAE, 0xA32DCB77, 0x0CF23080,
+    0x3BB7426A, 0xFA01ACBE,
+];
+
 // Device identifiers.
 const VENDOR_ID: u16 = 0x8086; // Intel.
 const DEVICE_ID: u16 = 0x100E; // 82540EM Gigabit Ethernet Controller.
+const DEVICE_ID_82574: u16 = 0x10D3; // 82574L Gigabit Network Connection.
+
+/// The supported members of the family.
+#[derive(Debug, Copy, Clone, PartialEq)]
+enum Model {
+    /// The 82540EM, with a single queue pair and legacy interrupts.
+    E82540,
+    /// The 82574L, with two queue pairs and MSI-X.
+    E82574,
+}
 
 // E1000 device registers.
 enum DeviceRegister {
     _CTRL = 0x00000,
     _STATUS = 0x00008,
     EERD = 0x0014,
+    CTRLEXT = 0x00018,
     ICR = 0x000C0,
+    ITR = 0x000C4,
     IMS = 0x000D0,
+    IMC = 0x000D8,
+    EIAC = 0x000DC,
+    IVAR = 0x000E4,
+    EITR = 0x000E8,
     RCTL = 0x00100,
     TIPG = 0x00410,
     RDBAL = 0x02800,
@@ -31,6 +111,8 @@ enum DeviceRegister {
     RDLEN = 0x02808,
     RDH = 0x02810,
     RDT = 0x02818,
+    RDTR = 0x02820,
+    RADV = 0x0282C,
     _TDFPC = 0x03430,
     TDBAL = 0x03800,
     TDBAH = 0x03804,
@@ -38,12 +120,35 @@ enum DeviceRegister {
     TDH = 0x03810,
     TDT = 0x03818,
     TCTL = 0x00400,
-    _GPTC = 0x04080,
-    _TPT = 0x040D4,
+    CRCERRS = 0x04000,
+    RXERRC = 0x0400C,
+    MPC = 0x04010,
+    COLC = 0x04028,
+    GPRC = 0x04074,
+    BPRC = 0x04078,
+    MPRC = 0x0407C,
+    GPTC = 0x04080,
+    GORCL = 0x04088,
+    GORCH = 0x0408C,
+    GOTCL = 0x04090,
+    GOTCH = 0x04094,
+    RNBC = 0x040A0,
+    RUC = 0x040A4,
+    ROC = 0x040AC,
+    TORL = 0x040C0,
+    TORH = 0x040C4,
+    TOTL = 0x040C8,
+    TOTH = 0x040CC,
+    TPR = 0x040D0,
+    TPT = 0x040D4,
+    RXCSUM = 0x05000,
+    RFCTL = 0x05008,
     RAL = 0x05400,
     RAH = 0x05404,
-    _MTA_LOW = 0x05200,
-    _MTA_HIGH = 0x053FC,
+    MTA = 0x05200,
+    MRQC = 0x05818,
+    RETA = 0x05C00,
+    RSSRK = 0x05C80,
     _PBM_START = 0x10000,
 }
 
@@ -62,9 +167,25 @@ enum InterruptMask {
     RXO = 1 << 6,
     /// Receiver Timer Interrupt
     RXT0 = 1 << 7,
+    /// Receive Queue 0 (82574, MSI-X)
+    RXQ0 = 1 << 20,
+    /// Transmit Queue 0 (82574, MSI-X)
+    TXQ0 = 1 << 22,
+    /// Other Causes (82574, MSI-X)
+    OTHER = 1 << 24,
 }
 
+/// The interrupts raised for received frames.
+const RX_INTERRUPTS: u32 = InterruptMask::RXSEQ as u32
+    | InterruptMask::RXDMTO as u32
+    | InterruptMask::RXO as u32
+    | InterruptMask::RXT0 as u32;
+
 /// The receive descriptor.
+///
+/// The 82574 writes back descriptors in the extended format, which overwrites
+/// the buffer address and moves the status and length fields. The fields are
+/// named for the legacy format.
 #[repr(C)]
 #[derive(Debug, Default)]
 struct RxDesc {
@@ -78,13 +199,156 @@ struct RxDesc {
 }
 
 impl RxDesc {
-    fn packet_size(&self) -> u16 {
-        self.length
+    fn packet_size(&self, extended: bool) -> u16 {
+        match extended {
+            false => self.length,
+            true => self.status as u16 | (self.errors as u16) << 8,
+        }
+    }
+
+    /// Return the low byte of the status field and the errors field. In the
+    /// extended format these are the first and last bytes of the dword
+    /// following the RSS hash, with the same bit assignments.
+    fn status_errors(&self, extended: bool) -> (u8, u8) {
+        match extended {
+            false => (self.status, self.errors),
+            true => {
+                let word = self.length as u32 | (self.checksum as u32) << 16;
+                (word as u8, (word >> 24) as u8)
+            }
+        }
     }
 
     /// Is the ed of packet (EOP) flag set?
-    fn end_of_packet(&self) -> bool {
-        self.status & (1 << 1) > 0
+    fn end_of_packet(&self, extended: bool) -> bool {
+        self.status_errors(extended).0 & (1 << 1) > 0
+    }
+
+    /// The checksums checked by the device, valid on the last descriptor of
+    /// a frame.
+    fn checksum(&self, extended: bool) -> RxChecksum {
+        let (status, errors) = self.status_errors(extended);
+
+        // Ignore checksum indication (IXSM).
+        if status & (1 << 2) > 0 {
+            return RxChecksum::UNCHECKED;
+        }
+
+        let status = |checked: u8, error: u8| {
+            if status & checked == 0 {
+                ChecksumStatus::Unchecked
+            } else if errors & error != 0 {
+                ChecksumStatus::Bad
+            } else {
+                ChecksumStatus::Good
+            }
+        };
+        RxChecksum {
+            // IPCS and IPE.
+            ip: status(1 << 6, 1 << 6),
+            // TCPCS and TCPE, which also cover UDP.
+            transport: status(1 << 5, 1 << 5),
+        }
+    }
+}
+/// Spare full page and half page receive buffers.
+struct RxBufferPool {
+    pages: FreeList,
+    halves: FreeList,
+}
+
+impl RxBufferPool {
+    const fn new() -> Self {
+        RxBufferPool {
+            pages: FreeList::new(),
+            halves: FreeList::new(),
+        }
+    }
+
+    /// Take a page from the pool, falling back to the page allocator.
+    fn alloc_page(&mut self) -> *mut u8 {
+        if let Some(page) = self.pages.pop() {
+            return page;
+        }
+        let page = unsafe { kalloc() as *mut u8 };
+        if page.is_null() {
+            panic!("rx buffer alloc failed\n\x00");
+        }
+        page
+    }
+
+    /// Return a page to the pool, or to the page allocator if the pool is full.
+    fn free_page(&mut self, page: *mut u8) {
+        if self.pages.len() == RX_POOL_MAX {
+            unsafe { kfree(page as *const _) };
+            return;
+        }
+        self.pages.push(page);
+    }
+
+    /// Take a half page from the pool, splitting a page if there are none.
+    fn alloc_half(&mut self) -> *mut u8 {
+        if let Some(half) = self.halves.pop() {
+            return half;
+        }
+        let page = self.alloc_page();
+        self.halves.push(unsafe { page.add(RX_HALF_SIZE) });
+        page
+    }
+
+    /// Return a half page to the pool. If the pool is full and the other half
+    /// of the page is also free, the whole page is freed instead.
+    fn free_half(&mut self, half: *mut u8) {
+        if self.halves.len() >= 2 * RX_POOL_MAX {
+            let buddy = (half as usize ^ RX_HALF_SIZE) as *mut u8;
+            if self.halves.remove(buddy) {
+                self.free_page((half as usize & !(PAGE_SIZE - 1)) as *mut u8);
+                return;
+            }
+        }
+        self.halves.push(half);
+    }
+}
+
+/// Allocate a receive buffer page.
+pub fn rx_page_alloc() -> *mut u8 {
+    RX_POOL.lock().alloc_page()
+}
+
+/// Release a receive buffer page loaned out in a PacketBuffer.
+pub fn rx_page_release(page: *mut u8) {
+    RX_POOL.lock().free_page(page)
+}
+
+/// Allocate a half page receive buffer.
+pub fn rx_half_alloc() -> *mut u8 {
+    RX_POOL.lock().alloc_half()
+}
+
+/// Release a half page receive buffer loaned out in a PacketBuffer.
+pub fn rx_half_release(half: *mut u8) {
+    RX_POOL.lock().free_half(half)
+}
+
+/// The receive buffer size for frames of up to `mtu` bytes of payload.
+///
+/// Frames at the standard MTU fit in a half page, halving the memory the
+/// receive ring pins down. Jumbo frames get whole pages, and a frame larger
+/// than a page spans several descriptors.
+fn rx_buffer_size(mtu: u32) -> usize {
+    if mtu as usize + HEADER_LEN <= RX_HALF_SIZE {
+        RX_HALF_SIZE
+    } else {
+        PAGE_SIZE
+    }
+}
+
+/// The functions allocating and releasing receive buffers of `size` bytes.
+fn rx_buffer_functions(size: usize) -> (fn() -> *mut u8, fn(*mut u8)) {
+    if size == RX_HALF_SIZE {
+        (rx_half_alloc, rx_half_release)
+    } else {
+        (rx_page_alloc, rx_page_release)
     }
 }
 
@@ -97,28 +361,368 @@ struct TxDesc {
     options: [u32; 2],
 }
 
+impl TxDesc {
+    /// Has the device written back the descriptor done (DD) flag?
+    fn done(&self) -> bool {
+        unsafe { core::ptr::read_volatile(&self.options[1]) & (1 << 0) > 0 }
+    }
+}
+
+/// Check `len` is a ring size the device supports.
+fn valid_ring_size(len: usize) -> Result<(), ()> {
+    if len == 0 || len > MAX_RING_SIZE || len % 8 != 0 {
+        return Err(());
+    }
+    Ok(())
+}
+
+/// A receive queue.
+struct RxRing {
+    /// Active receive descriptors.
+    desc: ContiguousArray<RxDesc>,
+
+    /// The buffer given to each receive descriptor. Kept apart from the
+    /// descriptors as extended descriptors are written back over the buffer
+    /// address.
+    bufs: ContiguousArray<PhysicalAddress>,
+
+    /// The size of each buffer, either a half or a whole page.
+    buf_size: usize,
+
+    /// Whether descriptors are written back in the extended format.
+    extended: bool,
+
+    /// The next receive descriptor to be read from.
+    idx: u32,
+}
+
+impl RxRing {
+    /// Allocate a receive ring of `len` descriptors, each with a buffer of
+    /// `buf_size` bytes.
+    fn new(len: usize, buf_size: usize, extended: bool) -> Result<RxRing, ()> {
+        valid_ring_size(len)?;
+        let mut desc = ContiguousArray::<RxDesc>::new(len).ok_or(())?;
+        let mut bufs = ContiguousArray::<PhysicalAddress>::new(len).ok_or(())?;
+
+        // Allocate a recieve buffer for each of the descriptors.
+        let (alloc, _) = rx_buffer_functions(buf_size);
+        for (desc, buf) in desc.iter_mut().zip(bufs.iter_mut()) {
+            *buf = PhysicalAddress::from_virtual(alloc() as u64);
+            desc.addr = *buf;
+        }
+
+        Ok(RxRing {
+            desc,
+            bufs,
+            buf_size,
+            extended,
+            idx: 0,
+        })
+    }
+
+    /// Return the number of descriptors in the ring.
+    fn len(&self) -> usize {
+        self.desc.len()
+    }
+
+    /// Take the buffer from the next receive descriptor and hand the
+    /// descriptor back to the device with a spare buffer in its place.
+    ///
+    /// The descriptor is not returned to the device until the tail is next
+    /// written.
+    fn take(&mut self) -> PacketBuffer {
+        let (alloc, release) = rx_buffer_functions(self.buf_size);
+        let idx = self.idx as usize;
+        let buf = self.bufs[idx].to_virtual().0 as *mut u8;
+        let size = self.desc[idx].packet_size(self.extended) as usize;
+        self.bufs[idx] = PhysicalAddress::from_virtual(alloc() as u64);
+
+        // Clear the written back fields, which must be zero when an extended
+        // descriptor is handed to the device.
+        self.desc[idx] = RxDesc {
+            addr: self.bufs[idx],
+            ..Default::default()
+        };
+
+        self.idx += 1;
+        if self.idx == self.len() as u32 {
+            self.idx = 0;
+        }
+
+        unsafe { PacketBuffer::new_loaned(buf, size, release) }
+    }
+}
+
+impl Drop for RxRing {
+    fn drop(&mut self) {
+        let (_, release) = rx_buffer_functions(self.buf_size);
+        for buf in self.bufs.iter() {
+            release(buf.to_virtual().0 as *mut u8);
+        }
+    }
+}
+
+/// A transmit queue.
+struct TxRing {
+    /// Active transmit descriptors.
+    desc: ContiguousArray<TxDesc>,
+
+    /// The transmit buffer owned by each transmit descriptor.
+    bufs: ContiguousArray<PhysicalAddress>,
+
+    /// The next transmit descriptor to be written to.
+    idx: u32,
+
+    /// The oldest transmit descriptor not yet reclaimed from the device.
+    clean: u32,
+
+    /// The checksum offload context last loaded into the device.
+    context: Option<TxChecksum>,
+}
+
+impl TxRing {
+    /// Allocate a transmit ring of `len` descriptors, each with a buffer.
+    fn new(len: usize) -> Result<TxRing, ()> {
+        valid_ring_size(len)?;
+        let mut ring = TxRing {
+            desc: ContiguousArray::new(len).ok_or(())?,
+            bufs: ContiguousArray::new(len).ok_or(())?,
+            idx: 0,
+            clean: 0,
+            context: None,
+        };
+
+        // For each transmission descriptor, allocate a data buffer and write
+        // the descriptor. Buffers already allocated are freed by drop() on
+        // failure.
+        for i in 0..len {
+            let buf = unsafe { kalloc() as *mut u8 };
+            if buf.is_null() {
+                return Err(());
+            }
+            ring.bufs[i] = PhysicalAddress::from_virtual(buf as u64);
+            ring.desc[i].addr = ring.bufs[i];
+        }
+        Ok(ring)
+    }
+
+    /// Return the number of descriptors in the ring.
+    fn len(&self) -> usize {
+        self.desc.len()
+    }
+
+    /// Reclaim transmit descriptors the device has finished with.
+    ///
+    /// Returns the number of descriptors reclaimed.
+    fn reclaim(&mut self) -> u32 {
+        let mut n = 0;
+        while self.clean != self.idx && self.desc[self.clean as usize].done() {
+            self.clean += 1;
+            if self.clean as usize == self.len() {
+                self.clean = 0;
+            }
+            n += 1;
+        }
+        n
+    }
+
+    /// Wait for the device to send every frame queued on the ring, for at
+    /// most TX_DRAIN_TIMEOUT_US. Returns false if it has not by then.
+    fn drain(&mut self) -> bool {
+        let deadline = rdtsc() + TX_DRAIN_TIMEOUT_US * CPU_FREQ_MHZ;
+        loop {
+            self.reclaim();
+            if self.clean == self.idx {
+                return true;
+            }
+            if rdtsc() > deadline {
+                return false;
+            }
+            core::hint::spin_loop();
+        }
+    }
+
+    /// Forget every frame queued on the ring. The device must be stopped
+    /// from reading the ring and reprogrammed with it afterwards.
+    fn reset(&mut self) {
+        self.idx = 0;
+        self.clean = 0;
+        self.context = None;
+    }
+
+    /// Return the number of transmit descriptors free for new frames.
+    ///
+    /// One descriptor is always left unused so that a full ring can be told
+    /// apart from an empty one.
+    fn free(&mut self) -> usize {
+        self.reclaim();
+        let len = self.len();
+        let in_flight = (self.idx as usize + len - self.clean as usize) % len;
+        len - 1 - in_flight
+    }
+
+    /// Advance past the next transmit descriptor, returning its index.
+    fn next(&mut self) -> usize {
+        let idx = self.idx as usize;
+        self.idx += 1;
+        if self.idx as usize == self.len() {
+            self.idx = 0;
+        }
+        idx
+    }
+
+    /// Return the number of descriptors needed to set up the checksum
+    /// offloads of a frame, in addition to its data descriptors.
+    fn context_needed(&self, checksum: Option<TxChecksum>) -> usize {
+        match checksum {
+            Some(x) if self.context != Some(x) => 1,
+            _ => 0,
+        }
+    }
+
+    /// Set up the checksum offloads for the next frame.
+    ///
+    /// The device keeps the last context loaded, so a context descriptor is
+    /// only queued when the offsets change. Returns the packet options
+    /// (POPTS) for the first data descriptor of the frame.
+    ///
+    /// Reference: Manual - Section 3.3.6
+    fn begin(&mut self, checksum: Option<TxChecksum>) -> u32 {
+        let checksum = match checksum {
+            Some(x) => x,
+            None => return 0,
+        };
+
+        if self.context != Some(checksum) {
+            // IPCSS, IPCSO and IPCSE.
+            let ip = match checksum.ip_header {
+                Some(x) => x as u32 | (x as u32 + 10) << 8 | (x as u32 + 19) << 16,
+                None => 0,
+            };
+            // TUCSS and TUCSO. A TUCSE of zero checksums to the end of frame.
+            let tu = match checksum.transport {
+                Some((start, field)) => start as u32 | (field as u32) << 8,
+                None => 0,
+            };
+
+            // The first two words of a context descriptor hold the offsets
+            // rather than a buffer address.
+            let idx = self.next();
+            let tx_desc = &mut self.desc[idx];
+            tx_desc.addr = PhysicalAddress(ip as u64 | (tu as u64) << 32);
+            // TUCMD: extended descriptor, report status and IPv4.
+            let tucmd = (1u32 << 5) | (1u32 << 3) | (1u32 << 1);
+            tx_desc.options[0] = tucmd << 24;
+            tx_desc.options[1] = 0;
+
+            self.context = Some(checksum);
+        }
+
+        let mut popts = 0;
+        if checksum.ip_header.is_some() {
+            popts |= 1 << 0; // Insert IP checksum (IXSM).
+        }
+        if checksum.transport.is_some() {
+            popts |= 1 << 1; // Insert TCP/UDP checksum (TXSM).
+        }
+        popts
+    }
+
+    /// Point the next transmit descriptor at `len` bytes at `addr`, with the
+    /// packet options `popts`.
+    ///
+    /// Returns the index of the descriptor used. The descriptor is not handed
+    /// to the device until the tail register is written.
+    fn queue(&mut self, addr: PhysicalAddress, len: usize, eop: bool, popts: u32) -> usize {
+        let idx = self.next();
+        let tx_desc = &mut self.desc[idx];
+        tx_desc.addr = addr;
+
+        // Only the last descriptor of a frame has the end of packet flag set.
+        let dtyp = 1u32 << 0;
+        let mut dcmd = (1u32 << 3) | (1u32 << 5);
+        if eop {
+            dcmd |= 1u32 << 0;
+        }
+        tx_desc.options[0] = len as u32 | (dtyp << 20) | (dcmd << 24);
+        tx_desc.options[1] = popts << 8;
+        idx
+    }
+
+    /// Copy `data` into the transmit buffers of as many descriptors as are
+    /// needed to hold it. The packet options `popts` are set on the first.
+    ///
+    /// Returns the index of the last descriptor used.
+    fn queue_copy(&mut self, data: &[u8], eop: bool, popts: u32) -> usize {
+        let mut idx = self.idx as usize;
+        let mut popts = popts;
+        let mut chunks = data.chunks(PAGE_SIZE).peekable();
+        while let Some(chunk) = chunks.next() {
+            let buf = self.bufs[self.idx as usize];
+            unsafe {
+                core::ptr::copy(chunk.as_ptr(), buf.to_virtual().0 as *mut u8, chunk.len());
+            }
+            idx = self.queue(buf, chunk.len(), eop && chunks.peek().is_none(), popts);
+            popts = 0;
+        }
+        idx
+    }
+}
+
+impl Drop for TxRing {
+    fn drop(&mut self) {
+        for addr in self.bufs.iter().filter(|x| x.0 != 0) {
+            unsafe { kfree(addr.to_virtual().0 as *const _) };
+        }
+    }
+}
+
 /// A representation of the e1000 family device state.
 pub struct E1000 {
     /// Base address of the memory mapped IO space of the device.
     mmio_base: u32,
 
+    /// The member of the family driven.
+    model: Model,
+
     /// The hardware (MAC) address of the device.
     hardware_address: Option<EthernetAddress>,
 
-    /// The protocol (IP) address of the device.
-    protocol_address: Option<Ipv4Addr>,
+    /// The receive queues. Received frames are spread across them by the RSS
+    /// hash of their IPv4 addresses.
+    rx: Vec<RxRing>,
 
-    /// Active receive descriptors.
-    rx: Vec<RxDesc>,
+    /// The transmit queues, one paired with each receive queue.
+    tx: Vec<TxRing>,
 
-    /// The next receive descriptor to be read from.
-    rx_idx: u32,
+    /// Whether each queue pair raises its own MSI-X vector, rather than every
+    /// cause sharing the legacy interrupt.
+    msix: bool,
 
-    /// Active transmit descriptors.
-    tx: Vec<TxDesc>,
+    /// Interrupt throttling interval (ITR), in 256ns units.
+    itr: u32,
 
-    /// The next transmit descriptor to be written to.
-    tx_idx: u32,
+    /// Receive delay timer (RDTR), in 1.024us units.
+    rdtr: u32,
+
+    /// Receive absolute delay timer (RADV), in 1.024us units.
+    radv: u32,
+
+    /// The largest frame payload sent or received.
+    mtu: u32,
+
+    /// Receive all frames, whatever their destination.
+    promiscuous: bool,
+
+    /// Multicast addresses received, with the number of times each has been
+    /// joined.
+    multicast: Vec<(EthernetAddress, u32)>,
+
+    /// Totals of the statistics registers, which clear when read.
+    stats: DeviceStats,
+
+    /// The tick the statistics registers were last read at.
+    stats_ticks: u32,
 }
 
 impl E1000 {
@@ -126,8 +730,7 @@ impl E1000 {
     ///
     /// By the end of this method, if successful, we will have:
     ///
-    ///  - Numberated the PCI bus and located an attached Intel 8254x family
-    ///    ethernet card
+    ///  - Checked `target_device` is an Intel 82540EM or 82574L ethernet card
     ///  - Stored the MMIO base address
     ///  - Stored the EEPROM based MAC address
     ///  - Configured the card as a bus master
@@ -135,57 +738,99 @@ impl E1000 {
     ///  - Setup transmit functions
     ///  - Setup interrupts
     ///
-    /// When reading the PCI configuration space, It is assumed that the memory
-    /// mapped address is held in the first BAR register.
-    pub unsafe fn new() -> Option<E1000> {
+    /// The first 82574L found is given a queue pair per MSI-X vector, each
+    /// vector aimed at a different CPU. When reading the PCI configuration
+    /// space, It is assumed that the memory mapped address is held in the
+    /// first BAR register. Returns None if the device is not such a card.
+    pub unsafe fn new(target_device: &PciConfig) -> Option<E1000> {
+        let model = match (target_device.vendor_id(), target_device.device_id()) {
+            (VENDOR_ID, DEVICE_ID) => Model::E82540,
+            (VENDOR_ID, DEVICE_ID_82574) => Model::E82574,
+            _ => return None,
+        };
+
         let mut e1000 = E1000 {
             mmio_base: 0x0,
+            model,
             hardware_address: None,
-            protocol_address: None,
             rx: vec![],
-            rx_idx: 0,
             tx: vec![],
-            tx_idx: 0,
+            msix: false,
+            itr: DEFAULT_ITR,
+            rdtr: 0,
+            radv: 0,
+            mtu: DEFAULT_MTU,
+            promiscuous: false,
+            multicast: vec![],
+            stats: DeviceStats::default(),
+            stats_ticks: 0,
         };
 
-        // Enumerate the first four devices on the first PCI bus.
-        // TODO: Move this out to a more generic PCI `probe` routine.
-        let mut target_device: Option<PciConfig> = None;
-        for device in 0..4 {
-            // Calculate the base address of the current device and load the
-            // PCI configuration struct for the device at the address.
-            let base_addr: u32 = 0x80000000 | (device << 11);
-            let pci_config = match PciConfig::new(base_addr) {
-                Ok(x) => {
-                    // Check if the device and vendor id match those of an
-                    // E1000 device.
-                    if x.vendor_id() != VENDOR_ID {
-                        continue;
-                    }
-                    if x.device_id() != DEVICE_ID {
-                        continue;
-                    }
+        // Configure the device command register and read the first BAR
+        // register as the MMIO base register.
+        target_device.set_bus_master();
+        e1000.mmio_base = target_device.bar(0);
+
+        // Read the MAC address.
+        e1000.hardware_address = Some(match model {
+            Model::E82540 => e1000.read_eeprom_address(),
+            // The 82574 loads its receive address registers from the NVM at
+            // reset, and its EERD register has a different layout.
+            Model::E82574 => {
+                let low = e1000.read_register(DeviceRegister::RAL).to_le_bytes();
+                let high = e1000.read_register(DeviceRegister::RAH).to_le_bytes();
+                EthernetAddress::from_slice(&[low[0], low[1], low[2], low[3], high[0], high[1]])
+            }
+        });
 
-                    // Device is an E1000, stop searching.
-                    target_device = Some(x);
-                    break;
+        // Route each queue pair's vector to its own CPU, with the vector for
+        // other causes after them. The vectors can only be claimed by one
+        // device. Fall back to a single queue pair if MSI-X cannot be set up.
+        let queues = match model {
+            Model::E82540 => 1,
+            Model::E82574 => {
+                let vectors: Vec<(u8, u8)> = (0..=MAX_QUEUES)
+                    .map(|v| (cpuapicid(v as i32) as u8, MSIX_VECTOR0 + v as u8))
+                    .collect();
+                if !MSIX_CLAIMED.swap(true, Ordering::Relaxed) {
+                    e1000.msix = target_device.enable_msix(&vectors).is_ok();
+                    MSIX_CLAIMED.store(e1000.msix, Ordering::Relaxed);
                 }
-                Err(_) => continue,
-            };
-        }
+                if e1000.msix {
+                    MAX_QUEUES
+                } else {
+                    1
+                }
+            }
+        };
+
+        // Setup receive functionality.
+        e1000.init_rx(queues);
+
+        // Setup trasmit functionality.
+        e1000.init_tx(queues);
+
+        // Setup interrupts.
+        e1000.init_interrupts();
 
-        if target_device.is_none() {
-            panic!("no network device\n\x00");
+        // Enable interrupts, by message if the device supports it rather than
+        // on the shared legacy interrupt line.
+        // TODO: Parse APICs tables to determine interrupts.
+        if !e1000.msix
+            && target_device
+                .enable_msi(cpuapicid(0) as u8, MSI_VECTOR)
+                .is_err()
+        {
+            ioapicenable(IRQ_PIC0, 0);
         }
 
-        // Configure the device command register and read the first BAR
-        // register as the MMIO base register.
-        target_device.as_ref().unwrap().set_bus_master();
-        e1000.mmio_base = target_device.unwrap().bar(0);
+        Some(e1000)
+    }
 
-        // Read the MAC address.
+    /// Read the MAC address from the EEPROM.
+    unsafe fn read_eeprom_address(&self) -> EthernetAddress {
         // TODO: Lock EEPROM.
-        let eerd_ptr = e1000.mmio_base + DeviceRegister::EERD as u32;
+        let eerd_ptr = self.mmio_base + DeviceRegister::EERD as u32;
         let mut hardware_addres = [0u8; 6];
         for i in 0..3 {
             core::ptr::write_volatile(eerd_ptr as *mut u32, 0x00000001 | i << 8);
@@ -198,24 +843,7 @@ impl E1000 {
             hardware_addres[(i * 2) as usize] = (data & 0xFF as u32) as u8;
             hardware_addres[(i * 2 + 1) as usize] = (data >> 8 & 0xFF as u32) as u8;
         }
-        e1000.hardware_address = Some(EthernetAddress::from_slice(&hardware_addres));
-
-        // Setup receive functionality.
-        e1000.init_rx();
-
-        // Setup trasmit functionality.
-        e1000.init_tx();
-
-        // Setup interrupts.
-        e1000.init_interrupts();
-
-        // Register the network device with the network stack.
-
-        // Enable interrupts.
-        // TODO: Parse APICs tables to determine interrupts.
-        ioapicenable(IRQ_PIC0, 0);
-
-        Some(e1000)
+        EthernetAddress::from_slice(&hardware_addres)
     }
 
     /// Receive initialization.
@@ -224,9 +852,11 @@ impl E1000 {
     ///
     /// - Program receive address registers with MAC address.
     /// - Zero out the multicast table array.
-    /// - Allocate a buffer to hold receive descriptors.
+    /// - Allocate a buffer to hold receive descriptors for each of `queues`
+    ///   receive queues.
+    /// - Setup receive side scaling if there is more than one queue.
     /// - Setup the receive controller register.
-    unsafe fn init_rx(&mut self) {
+    unsafe fn init_rx(&mut self, queues: usize) {
         // Write the MAC addres into the RAL and RAH registers.
         // Pad the MAC address to 8 bytes.
         match &self.hardware_address {
@@ -238,69 +868,179 @@ impl E1000 {
                 let mac_low: u32 = u32::from_le_bytes(mac_padded[..4].try_into().unwrap());
                 self.write_register(DeviceRegister::RAL, mac_low);
 
-                // ...and high bytes of the MAC address.
+                // ...and high bytes of the MAC address, marking the address
+                // valid (AV) so the device matches against it.
                 let mac_high: u32 = u32::from_le_bytes(mac_padded[4..].try_into().unwrap());
-                self.write_register(DeviceRegister::RAH, mac_high);
+                self.write_register(DeviceRegister::RAH, mac_high | 1 << 31);
             }
             None => panic!("no mac address\n\x00"),
         }
-        // Allocate a recieve buffer for each of the descriptors.
-        self.rx.resize_with(256, Default::default);
-        for desc in self.rx.iter_mut() {
-            let buf = kalloc() as *mut u8;
-            desc.addr = PhysicalAddress::from_virtual(buf as u64);
-        }
-
-        // Setup the receive descriptor buffer registers.
-        self.write_register(
-            DeviceRegister::RDBAL,
-            PhysicalAddress::from_virtual(self.rx.as_ptr() as u64).0 as u32,
-        );
-        self.write_register(DeviceRegister::RDBAH, 0x0);
-        self.write_register(DeviceRegister::RDLEN, PAGE_SIZE as u32);
-        self.write_register(DeviceRegister::RDH, 0);
-        // Point the receive descriptor tail one past the last valid descriptor.
-        self.write_register(DeviceRegister::RDT, (self.rx.len() - 1) as u32);
+        self.update_mta();
+
+        // The 82574 needs extended descriptors for receive side scaling.
+        let extended = self.model == Model::E82574;
+        if extended {
+            let rfctl = self.read_register(DeviceRegister::RFCTL);
+            self.write_register(DeviceRegister::RFCTL, rfctl | 1 << 15);
+        }
 
-        // Set up the receive control register.
+        let buf_size = rx_buffer_size(self.mtu);
+        for _ in 0..queues {
+            match RxRing::new(DEFAULT_RX_RING_SIZE, buf_size, extended) {
+                Ok(x) => self.rx.push(x),
+                Err(_) => panic!("rx ring alloc failed\n\x00"),
+            }
+        }
+        for queue in 0..queues {
+            self.program_rx_ring(queue);
+        }
+
+        // Set up the receive control register, then enable the receiver once
+        // the buffer size is set.
         let mut rctl: u32 = 0x0;
-        rctl |= 1 << 1; // Receiver enable.
-        rctl |= 1 << 2; // Store bad packets.
-        rctl |= 1 << 3; // Receive all unicast packets.
-        rctl |= 1 << 4; // Receive all multicast packets.
-        rctl |= 1 << 5; // Receivce long packets.
         rctl |= 1 << 15; // Accept broadcast packets.
-        rctl |= 3 << 16; // Buffer size (4069 bytes).
-        rctl |= 1 << 25; // Buffer size extension.
+        rctl |= 1 << 26; // Strip ethernet CRC.
+        self.write_register(DeviceRegister::RCTL, rctl);
+        self.update_rctl();
+        rctl = self.read_register(DeviceRegister::RCTL);
+        self.write_register(DeviceRegister::RCTL, rctl | 1 << 1);
+
+        // Check IPv4, TCP and UDP checksums of received frames.
+        let mut rxcsum = 0;
+        rxcsum |= 1 << 8; // IP checksum offload.
+        rxcsum |= 1 << 9; // TCP/UDP checksum offload.
+        if queues > 1 {
+            rxcsum |= 1 << 13; // Report the RSS hash, not the packet checksum.
+        }
+        self.write_register(DeviceRegister::RXCSUM, rxcsum);
+
+        if queues > 1 {
+            self.init_rss();
+        }
+    }
+
+    /// Spread received frames across the receive queues by the RSS hash of
+    /// their IPv4 source and destination addresses.
+    ///
+    /// Each byte of the redirection table (RETA) picks the queue for one
+    /// value of the low bits of the hash, from bit 7 on the 82574. The table
+    /// alternates between the two queues. The 82574 only hashes the ports of
+    /// TCP segments, so all UDP traffic between two hosts lands on one queue.
+    unsafe fn init_rss(&mut self) {
+        for (i, x) in RSS_KEY.iter().enumerate() {
+            self.write_register_array(DeviceRegister::RSSRK, i, *x);
+        }
+        for i in 0..32 {
+            self.write_register_array(DeviceRegister::RETA, i, 0x80008000);
+        }
+
+        let mut mrqc = 0;
+        mrqc |= 1 << 0; // Enable RSS.
+        mrqc |= 1 << 16; // Hash TCP over IPv4.
+        mrqc |= 1 << 17; // Hash other IPv4.
+        self.write_register(DeviceRegister::MRQC, mrqc);
+    }
+
+    /// Hand the descriptors of receive queue `queue` to the device.
+    unsafe fn program_rx_ring(&self, queue: usize) {
+        let ring = &self.rx[queue];
+        let rdbal = ring.desc.physical_address().0 as u32;
+        self.write_queue_register(DeviceRegister::RDBAL, queue, rdbal);
+        self.write_queue_register(DeviceRegister::RDBAH, queue, 0x0);
+        let rdlen = ring.len() * core::mem::size_of::<RxDesc>();
+        self.write_queue_register(DeviceRegister::RDLEN, queue, rdlen as u32);
+        self.write_queue_register(DeviceRegister::RDH, queue, 0);
+        // Point the receive descriptor tail one past the last valid descriptor.
+        self.write_queue_register(DeviceRegister::RDT, queue, (ring.len() - 1) as u32);
+    }
+
+    /// Replace every receive ring with one of `len` descriptors, with buffers
+    /// of `buf_size` bytes.
+    ///
+    /// All the new rings are allocated before the receiver is stopped, so on
+    /// failure the current rings are kept. Frames left in the old rings are
+    /// dropped.
+    unsafe fn resize_rx_rings(&mut self, len: usize, buf_size: usize) -> Result<(), ()> {
+        let extended = self.model == Model::E82574;
+        let mut rings = Vec::with_capacity(self.rx.len());
+        for _ in 0..self.rx.len() {
+            rings.push(RxRing::new(len, buf_size, extended)?);
+        }
+
+        let rctl = self.read_register(DeviceRegister::RCTL);
+        self.write_register(DeviceRegister::RCTL, rctl & !(1 << 1));
+        self.rx = rings;
+        for queue in 0..self.rx.len() {
+            self.program_rx_ring(queue);
+        }
+        self.update_rctl();
+        let rctl = self.read_register(DeviceRegister::RCTL) | rctl & (1 << 1);
+        self.write_register(DeviceRegister::RCTL, rctl);
+        Ok(())
+    }
+
+    /// Update the receive control register for the MTU, buffer size and
+    /// receive mode.
+    ///
+    /// Long packets (LPE) are only accepted when the MTU needs them, so the
+    /// device drops oversized frames itself at the standard MTU. Frames for
+    /// other hosts are only accepted (UPE and MPE) in promiscuous mode.
+    unsafe fn update_rctl(&mut self) {
+        let mut rctl = self.read_register(DeviceRegister::RCTL);
+        rctl &= !(1 << 3 | 1 << 4 | 1 << 5 | 3 << 16 | 1 << 25);
+        if self.mtu > DEFAULT_MTU {
+            rctl |= 1 << 5; // Receive long packets.
+        }
+        if self.rx[0].buf_size == PAGE_SIZE {
+            rctl |= 3 << 16; // Buffer size (4096 bytes).
+            rctl |= 1 << 25; // Buffer size extension.
+        }
+        if self.promiscuous {
+            rctl |= 1 << 3; // Receive all unicast packets.
+            rctl |= 1 << 4; // Receive all multicast packets.
+        }
         self.write_register(DeviceRegister::RCTL, rctl);
     }
 
+    /// Rewrite the multicast table array (MTA) from the joined addresses.
+    ///
+    /// The device hashes the destination of multicast frames to one of 4096
+    /// bits in the table, and accepts the frame if the bit is set. With the
+    /// default offset (MO = 0) the hash is bits 36 to 47 of the address.
+    ///
+    /// Reference: Manual - Section 13.5.1
+    unsafe fn update_mta(&mut self) {
+        let mut mta = [0u32; 128];
+        for (addr, _) in self.multicast.iter() {
+            let bytes = addr.as_bytes();
+            let hash = ((bytes[4] >> 4) as usize | (bytes[5] as usize) << 4) & 0xFFF;
+            mta[hash >> 5] |= 1 << (hash & 0x1F);
+        }
+        for (i, x) in mta.iter().enumerate() {
+            self.write_register_array(DeviceRegister::MTA, i, *x);
+        }
+    }
+
     /// Transmission initialization.
     ///
     /// Reference: Manual - Section 14.5
     ///
-    /// - Allocate a buffer to hold transmission descriptors.
+    /// - Allocate a buffer to hold transmission descriptors for each of
+    ///   `queues` transmit queues.
     /// - Initialize the transmit descriptor buffer registers.
     /// - Setup the transmission control register.
     /// - Setup the transmission inter-packet gap register.
 
-    unsafe fn init_tx(&mut self) {
-        // Allocate the transmission data buffer list and then for each transmission
-        // descriptor, allocate a data buffer and write the descriptor.
-        self.tx.resize_with(256, Default::default);
-        for desc in self.tx.iter_mut() {
-            let buf = kalloc() as *mut u8;
-            desc.addr = PhysicalAddress::from_virtual(buf as u64);
+    unsafe fn init_tx(&mut self, queues: usize) {
+        for _ in 0..queues {
+            match TxRing::new(DEFAULT_TX_RING_SIZE) {
+                Ok(x) => self.tx.push(x),
+                Err(_) => panic!("tx ring alloc failed\n\x00"),
+            }
+        }
+        for queue in 0..queues {
+            self.program_tx_ring(queue);
         }
-        self.tx_idx = 1;
-
-        // Setup the transmit descriptor buffer registers.
-        let tx_buf = VirtualAddress::new(self.tx.as_ptr() as u64);
-        self.write_register(DeviceRegister::TDBAL, tx_buf.to_physical().0 as u32);
-        self.write_register(DeviceRegister::TDBAH, 0x0);
-        self.write_register(DeviceRegister::TDLEN, PAGE_SIZE as u32);
-        self.write_register(DeviceRegister::TDH, 0);
-        self.write_register(DeviceRegister::TDT, 0);
 
         // Setup the transmission control TCTL register.
         let mut tctl: u32 = 0x0;
@@ -314,18 +1054,123 @@ impl E1000 {
         self.write_register(DeviceRegister::TIPG, 0xA);
     }
 
+    /// Hand the descriptors of transmit queue `queue` to the device.
+    unsafe fn program_tx_ring(&self, queue: usize) {
+        let ring = &self.tx[queue];
+        let tdbal = ring.desc.physical_address().0 as u32;
+        self.write_queue_register(DeviceRegister::TDBAL, queue, tdbal);
+        self.write_queue_register(DeviceRegister::TDBAH, queue, 0x0);
+        let tdlen = ring.len() * core::mem::size_of::<TxDesc>();
+        self.write_queue_register(DeviceRegister::TDLEN, queue, tdlen as u32);
+        self.write_queue_register(DeviceRegister::TDH, queue, 0);
+        self.write_queue_register(DeviceRegister::TDT, queue, 0);
+    }
+
+    /// Drop the frames queued on transmit queue `queue`. The transmitter is
+    /// stopped while the ring is reprogrammed, so the device no longer reads
+    /// the memory of the dropped frames.
+    unsafe fn reset_tx_ring(&mut self, queue: usize) {
+        let tctl = self.read_register(DeviceRegister::TCTL);
+        self.write_register(DeviceRegister::TCTL, tctl & !(1 << 1));
+        self.tx[queue].reset();
+        self.program_tx_ring(queue);
+        self.write_register(DeviceRegister::TCTL, tctl);
+    }
+
+    /// Replace every transmit ring with one of `len` descriptors, once the
+    /// device has sent every frame queued on the current rings.
+    ///
+    /// On failure, including when the frames in flight are not sent in time
+    /// as when the link is down, the current rings are kept.
+    unsafe fn resize_tx_rings(&mut self, len: usize) -> Result<(), ()> {
+        let mut rings = Vec::with_capacity(self.tx.len());
+        for _ in 0..self.tx.len() {
+            rings.push(TxRing::new(len)?);
+        }
+
+        for ring in self.tx.iter_mut() {
+            if !ring.drain() {
+                return Err(());
+            }
+        }
+        let tctl = self.read_register(DeviceRegister::TCTL);
+        self.write_register(DeviceRegister::TCTL, tctl & !(1 << 1));
+        self.tx = rings;
+        for queue in 0..self.tx.len() {
+            self.program_tx_ring(queue);
+        }
+        self.write_register(DeviceRegister::TCTL, tctl);
+        Ok(())
+    }
+
     /// Configure interrupts.
+    ///
+    /// Interrupts are moderated by the throttling (ITR) and receive delay
+    /// (RDTR, RADV) timers so the device does not interrupt for every frame.
+    ///
+    /// Under MSI-X each queue pair raises its own vector, and the causes
+    /// behind those vectors are cleared when the message is sent (EIAC)
+    /// rather than by reading the interrupt cause register. Everything else,
+    /// link changes and overruns, raises the vector for other causes.
     unsafe fn init_interrupts(&mut self) {
+        self.write_register(DeviceRegister::ITR, self.itr);
+        self.write_register(DeviceRegister::RDTR, self.rdtr);
+        self.write_register(DeviceRegister::RADV, self.radv);
+
         let mut ims: u32 = 0x0;
-        ims |= 1 << 0;
-        ims |= 1 << 2;
-        ims |= 1 << 3;
-        ims |= 1 << 4;
-        ims |= 1 << 6;
-        ims |= 1 << 7;
+        ims |= InterruptMask::LSC as u32;
+        if !self.msix {
+            ims |= InterruptMask::TXDW as u32;
+            ims |= RX_INTERRUPTS;
+            self.write_register(DeviceRegister::IMS, ims);
+            return;
+        }
+
+        // Map the receive and transmit causes of queue pair n to vector n,
+        // and other causes to the vector after them. Each 4 bit field is the
+        // vector with the valid bit (bit 3) set.
+        let queues = self.rx.len();
+        let mut ivar = 0;
+        for queue in 0..queues {
+            let entry = 1 << 3 | queue as u32;
+            ivar |= entry << (4 * queue); // Receive queue.
+            ivar |= entry << (8 + 4 * queue); // Transmit queue.
+        }
+        ivar |= (1 << 3 | queues as u32) << 16; // Other causes.
+        ivar |= 1 << 31; // Interrupt on every transmit write back.
+        self.write_register(DeviceRegister::IVAR, ivar);
+
+        let ctrl_ext = self.read_register(DeviceRegister::CTRLEXT);
+        self.write_register(DeviceRegister::CTRLEXT, ctrl_ext | 1 << 31); // PBA_CLR.
+
+        let mut eiac = 0;
+        for queue in 0..queues {
+            eiac |= self.queue_interrupts(queue);
+        }
+        self.write_register(DeviceRegister::EIAC, eiac);
+        for vector in 0..=queues {
+            self.write_register_array(DeviceRegister::EITR, vector, self.itr);
+        }
+
+        ims |= eiac;
+        ims |= InterruptMask::OTHER as u32;
+        ims |= InterruptMask::RXO as u32;
         self.write_register(DeviceRegister::IMS, ims);
     }
 
+    /// The MSI-X receive and transmit causes of queue pair `queue`.
+    fn queue_interrupts(&self, queue: usize) -> u32 {
+        (InterruptMask::RXQ0 as u32 | InterruptMask::TXQ0 as u32) << queue
+    }
+
+    /// The receive interrupts of queue `queue`, masked while it is polled.
+    fn rx_interrupts(&self, queue: usize) -> u32 {
+        match self.msix {
+            false => RX_INTERRUPTS,
+            true => (InterruptMask::RXQ0 as u32) << queue,
+        }
+    }
+
     /// Read a device register.
     unsafe fn read_register(&self, r: DeviceRegister) -> u32 {
         return core::ptr::read_volatile((self.mmio_base + r as u32) as *const u32);
@@ -335,6 +1180,114 @@ impl E1000 {
     unsafe fn write_register(&self, r: DeviceRegister, data: u32) {
         core::ptr::write_volatile((self.mmio_base + r as u32) as *mut u32, data);
     }
+
+    /// Read a register of receive or transmit queue `queue`, where `r` is the
+    /// register of the first queue.
+    unsafe fn read_queue_register(&self, r: DeviceRegister, queue: usize) -> u32 {
+        let addr = self.mmio_base + r as u32 + QUEUE_REGISTER_STRIDE * queue as u32;
+        core::ptr::read_volatile(addr as *const u32)
+    }
+
+    /// Write a register of receive or transmit queue `queue`, where `r` is
+    /// the register of the first queue.
+    unsafe fn write_queue_register(&self, r: DeviceRegister, queue: usize, data: u32) {
+        let addr = self.mmio_base + r as u32 + QUEUE_REGISTER_STRIDE * queue as u32;
+        core::ptr::write_volatile(addr as *mut u32, data);
+    }
+
+    /// Read a 64 bit register pair, low half first.
+    unsafe fn read_register64(&self, low: DeviceRegister, high: DeviceRegister) -> u64 {
+        let low = self.read_register(low) as u64;
+        low | (self.read_register(high) as u64) << 32
+    }
+
+    /// Fold the statistics registers into the software totals.
+    ///
+    /// The registers clear when read, so they must be read often enough that
+    /// they cannot wrap between reads.
+    ///
+    /// Reference: Manual - Section 13.7
+    unsafe fn update_stats(&mut self) {
+        let mut s = self.stats;
+        s.rx_packets += self.read_register(DeviceRegister::TPR) as u64;
+        s.rx_good_packets += self.read_register(DeviceRegister::GPRC) as u64;
+        s.rx_broadcast += self.read_register(DeviceRegister::BPRC) as u64;
+        s.rx_multicast += self.read_register(DeviceRegister::MPRC) as u64;
+        s.rx_bytes += self.read_register64(DeviceRegister::TORL, DeviceRegister::TORH);
+        s.rx_good_bytes += self.read_register64(DeviceRegister::GORCL, DeviceRegister::GORCH);
+        s.rx_crc_errors += self.read_register(DeviceRegister::CRCERRS) as u64;
+        s.rx_errors += self.read_register(DeviceRegister::RXERRC) as u64;
+        s.rx_missed += self.read_register(DeviceRegister::MPC) as u64;
+        s.rx_no_buffers += self.read_register(DeviceRegister::RNBC) as u64;
+        s.rx_undersize += self.read_register(DeviceRegister::RUC) as u64;
+        s.rx_oversize += self.read_register(DeviceRegister::ROC) as u64;
+        s.tx_packets += self.read_register(DeviceRegister::TPT) as u64;
+        s.tx_good_packets += self.read_register(DeviceRegister::GPTC) as u64;
+        s.tx_bytes += self.read_register64(DeviceRegister::TOTL, DeviceRegister::TOTH);
+        s.tx_good_bytes += self.read_register64(DeviceRegister::GOTCL, DeviceRegister::GOTCH);
+        s.collisions += self.read_register(DeviceRegister::COLC) as u64;
+        self.stats = s;
+        self.stats_ticks = core::ptr::read_volatile(&ticks);
+    }
+
+    /// Write to the `i`th register of a device register array.
+    unsafe fn write_register_array(&self, r: DeviceRegister, i: usize, data: u32) {
+        let addr = self.mmio_base + r as u32 + 4 * i as u32;
+        core::ptr::write_volatile(addr as *mut u32, data);
+    }
+
+    /// Handle the causes reported in the interrupt cause register, which is
+    /// cleared by the read.
+    unsafe fn clear_causes(&mut self, status: &mut InterruptStatus) {
+        let mask = self.read_register(DeviceRegister::ICR);
+        if mask & InterruptMask::TXDW as u32 != 0 {
+            status.tx_done = self.tx[0].reclaim() > 0;
+        }
+        if mask & InterruptMask::TXQE as u32 != 0 {
+            // cprint(b"e1000: tx queue empty\n\x00".as_ptr());
+        }
+        if mask & InterruptMask::LSC as u32 != 0 {
+            // cprint(b"e1000: link status change seq
+            // error\n\x00".as_ptr());
+        }
+        if mask & InterruptMask::RXSEQ as u32 != 0 {
+            // cprint(b"e1000: rx seq error\n\x00".as_ptr());
+        }
+        if mask & InterruptMask::RXDMTO as u32 != 0 {
+            // cprint(b"e1000: rx min threshold\n\x00".as_ptr());
+        }
+        if mask & InterruptMask::RXO as u32 != 0 {
+            // The receive FIFO overflowed because the ring was full. The
+            // poller is scheduled to drain the ring; count the frames lost
+            // and turn interrupt moderation back on if it was disabled, as
+            // the CPU is not keeping up.
+            status.rx_overrun = true;
+            let missed = self.stats.rx_missed;
+            self.update_stats();
+            status.rx_missed = (self.stats.rx_missed - missed) as u32;
+            if self.itr == 0 {
+                self.itr = DEFAULT_ITR;
+                self.write_itr();
+            }
+        }
+        if mask & InterruptMask::RXT0 as u32 != 0 {
+            // cprint(b"e1000: rx min threshold\n\x00".as_ptr());
+        }
+        if !self.msix && mask & RX_INTERRUPTS != 0 {
+            status.rx_queues = 1;
+        }
+    }
+
+    /// Write the interrupt throttling interval to the device, and to each
+    /// MSI-X vector.
+    unsafe fn write_itr(&self) {
+        self.write_register(DeviceRegister::ITR, self.itr);
+        if self.msix {
+            for vector in 0..=self.rx.len() {
+                self.write_register_array(DeviceRegister::EITR, vector, self.itr);
+            }
+        }
+    }
 }
 
 /// Implement the common network interface.
@@ -346,96 +1299,312 @@ impl NetworkDevice for E1000 {
         }
     }
 
-    /// TODO: Perfectly valid not to have a protocol address.
-    fn protocol_address(&self) -> Ipv4Addr {
-        match self.protocol_address {
+    fn queues(&self) -> usize {
+        self.rx.len()
+    }
+
+    fn parameter(&self, param: DeviceParameter) -> Option<u32> {
+        match param {
+            DeviceParameter::InterruptThrottle => Some(self.itr),
+            DeviceParameter::RxDelay => Some(self.rdtr),
+            DeviceParameter::RxAbsoluteDelay => Some(self.radv),
+            DeviceParameter::Mtu => Some(self.mtu),
+            DeviceParameter::Promiscuous => Some(self.promiscuous as u32),
+            DeviceParameter::RxRingSize => Some(self.rx[0].len() as u32),
+            DeviceParameter::TxRingSize => Some(self.tx[0].len() as u32),
+        }
+    }
+
+    fn set_parameter(&mut self, param: DeviceParameter, value: u32) -> Result<(), ()> {
+        match param {
+            DeviceParameter::Mtu => {
+                if value < MIN_MTU || value > MAX_MTU {
+                    return Err(());
+                }
+                let mtu = self.mtu;
+                self.mtu = value;
+                let buf_size = rx_buffer_size(value);
+                if buf_size != self.rx[0].buf_size {
+                    // The rings are left as they were if they cannot be
+                    // reallocated, so keep the old MTU too.
+                    if unsafe { self.resize_rx_rings(self.rx[0].len(), buf_size) }.is_err() {
+                        self.mtu = mtu;
+                        return Err(());
+                    }
+                }
+                unsafe { self.update_rctl() };
+                return Ok(());
+            }
+            DeviceParameter::Promiscuous => {
+                if value > 1 {
+                    return Err(());
+                }
+                self.promiscuous = value == 1;
+                unsafe { self.update_rctl() };
+                return Ok(());
+            }
+            DeviceParameter::RxRingSize => {
+                return unsafe { self.resize_rx_rings(value as usize, self.rx[0].buf_size) };
+            }
+            DeviceParameter::TxRingSize => return unsafe { self.resize_tx_rings(value as usize) },
+            _ => (),
+        }
+
+        // The timers are 16 bit registers.
+        if value > 0xFFFF {
+            return Err(());
+        }
+        unsafe {
+            match param {
+                DeviceParameter::InterruptThrottle => {
+                    self.itr = value;
+                    self.write_itr();
+                }
+                DeviceParameter::RxDelay => {
+                    self.rdtr = value;
+                    self.write_register(DeviceRegister::RDTR, value);
+                }
+                DeviceParameter::RxAbsoluteDelay => {
+                    self.radv = value;
+                    self.write_register(DeviceRegister::RADV, value);
+                }
+                _ => (),
+            }
+        }
+        Ok(())
+    }
+
+    fn join_multicast(&mut self, addr: EthernetAddress) {
+        match self.multicast.iter_mut().find(|x| x.0 == addr) {
+            Some(x) => x.1 += 1,
+            None => {
+                self.multicast.push((addr, 1));
+                unsafe { self.update_mta() };
+            }
+        }
+    }
+
+    fn leave_multicast(&mut self, addr: EthernetAddress) {
+        let i = match self.multicast.iter().position(|x| x.0 == addr) {
             Some(x) => x,
-            None => panic!("protocol address not set\n\x00"),
+            None => return,
+        };
+        self.multicast[i].1 -= 1;
+        if self.multicast[i].1 == 0 {
+            self.multicast.remove(i);
+            unsafe { self.update_mta() };
         }
     }
 
-    fn set_protocol_address(&mut self, protocol_address: Ipv4Addr) {
-        self.protocol_address = Some(protocol_address);
+    /// The 82540EM and 82574L insert IPv4, TCP and UDP checksums on
+    /// transmit.
+    fn offload(&self) -> Offload {
+        Offload {
+            tx_ip_checksum: true,
+            tx_udp_checksum: true,
+        }
+    }
+
+    /// The statistics registers are also folded in from the interrupt
+    /// handler at most once every STATS_INTERVAL ticks.
+    fn stats(&mut self) -> DeviceStats {
+        unsafe { self.update_stats() };
+        self.stats
     }
 
     /// Clear the current state of the interrupt register.
-    fn clear_interrupts(&mut self) {
-        // Read the interrupt register and dispatch to the correct handler.
+    ///
+    /// A queue pair's MSI-X vector does not say whether it was raised for
+    /// received or transmitted frames, so its transmit ring is reclaimed and
+    /// its receive ring is reported if the device has written frames to it.
+    fn clear_interrupts(&mut self, vector: Option<usize>) -> InterruptStatus {
+        let mut status = InterruptStatus::default();
+
         unsafe {
-            let mask = self.read_register(DeviceRegister::ICR);
-            if mask & InterruptMask::TXDW as u32 != 0 {
-                // cprint(b"e1000: tx descriptor write-back\n\x00".as_ptr());
-            } else if mask & InterruptMask::TXQE as u32 != 0 {
-                // cprint(b"e1000: tx queue empty\n\x00".as_ptr());
-            } else if mask & InterruptMask::LSC as u32 != 0 {
-                // cprint(b"e1000: link status change seq
-                // error\n\x00".as_ptr());
-            } else if mask & InterruptMask::RXSEQ as u32 != 0 {
-                // cprint(b"e1000: rx seq error\n\x00".as_ptr());
-            } else if mask & InterruptMask::RXDMTO as u32 != 0 {
-                // cprint(b"e1000: rx min threshold\n\x00".as_ptr());
-            } else if mask & InterruptMask::RXO as u32 != 0 {
-                panic!("receiver overrun\n\x00");
-            } else if mask & InterruptMask::RXT0 as u32 != 0 {
-                // cprint(b"e1000: rx min threshold\n\x00".as_ptr());
+            match vector {
+                // Raised by another device's MSI-X vectors.
+                Some(_) if !self.msix => return status,
+                Some(queue) if queue < self.rx.len() => {
+                    status.tx_done = self.tx[queue].reclaim() > 0;
+                    let head = self.read_queue_register(DeviceRegister::RDH, queue);
+                    if head != self.rx[queue].idx {
+                        status.rx_queues = 1 << queue;
+                    }
+                }
+                _ => {
+                    self.clear_causes(&mut status);
+                    if self.msix {
+                        // Reading the cause register masks other causes.
+                        let ims = InterruptMask::OTHER as u32
+                            | InterruptMask::LSC as u32
+                            | InterruptMask::RXO as u32;
+                        self.write_register(DeviceRegister::IMS, ims);
+                    }
+                }
+            }
+
+            let now = core::ptr::read_volatile(&ticks);
+            if now.wrapping_sub(self.stats_ticks) >= STATS_INTERVAL {
+                self.update_stats();
             }
         }
+
+        status
     }
 
-    /// Send the contents of a PacketBuffer over the wire.
-    fn send(&mut self, buf: PacketBuffer) {
-        let mut tx_desc = &mut self.tx[self.tx_idx as usize];
+    /// Mask receive interrupts of queue `queue`.
+    fn disable_rx_interrupts(&mut self, queue: usize) {
+        unsafe {
+            self.write_register(DeviceRegister::IMC, self.rx_interrupts(queue));
+        }
+    }
 
-        // Write the payload into the transmit buffer.
-        let tx_buf = tx_desc.addr.to_virtual().0 as *mut u8;
+    /// Unmask receive interrupts of queue `queue`. Causes latched while they
+    /// were masked raise an interrupt straight away.
+    fn enable_rx_interrupts(&mut self, queue: usize) -> bool {
         unsafe {
-            core::ptr::copy(buf.as_ptr(), tx_buf, buf.len());
+            self.write_register(DeviceRegister::IMS, self.rx_interrupts(queue));
         }
+        false
+    }
 
-        // Setup the transmit descriptor.
-        let size = buf.len() as u32;
-        let dtyp = 1u32 << 0;
-        let dcmd = (1u32 << 0) | (1u32 << 3) | (1u32 << 5);
-        tx_desc.options[0] = size | (dtyp << 20) | (dcmd << 24);
+    /// Send the contents of a PacketBuffer over the wire.
+    fn send(&mut self, buf: PacketBuffer) -> Result<(), TxError> {
+        self.send_gather(buf, &[])
+    }
+
+    /// Send a header and payload fragments over the wire as one frame, on
+    /// the first transmit queue.
+    ///
+    /// Each fragment is given its own descriptors, with the end of packet flag
+    /// set on the last. Direct fragments are read by the device in place, so
+    /// wait for the frame to be written back before returning them.
+    fn send_gather(&mut self, header: PacketBuffer, payload: &[TxFragment]) -> Result<(), TxError> {
+        let ring = &mut self.tx[0];
 
-        self.tx_idx += 1;
-        if self.tx_idx as usize == self.tx.len() {
-            self.tx_idx = 0;
+        // Check the whole frame fits before queuing any of it.
+        let checksum = header.tx_checksum();
+        let mut needed = ring.context_needed(checksum) + header.len().div_ceil(PAGE_SIZE);
+        for fragment in payload {
+            needed += match fragment {
+                TxFragment::Copy(data) => data.len().div_ceil(PAGE_SIZE),
+                TxFragment::Direct(_, _) => 1,
+            };
         }
-        unsafe {
-            self.write_register(DeviceRegister::TDT, self.tx_idx);
+        if needed > ring.free() {
+            return Err(TxError::RingFull);
         }
-    }
 
-    /// Read avaliable packets from the device.
-    /// TODO: Loan PacketBuffer?
-    fn recv(&mut self) -> Option<PacketBuffer> {
+        let popts = ring.begin(checksum);
+        ring.queue_copy(header.as_slice(), payload.is_empty(), popts);
+
+        let mut direct = false;
+        for (i, fragment) in payload.iter().enumerate() {
+            let eop = i == payload.len() - 1;
+            match fragment {
+                TxFragment::Copy(data) => ring.queue_copy(data, eop, 0),
+                TxFragment::Direct(addr, len) => {
+                    direct = true;
+                    ring.queue(*addr, *len, eop, 0)
+                }
+            };
+        }
+
+        let tail = ring.idx;
         unsafe {
-            let head = self.read_register(DeviceRegister::RDH);
-            if self.rx_idx == head {
-                // Ring buffer is empty.
-                return None;
-            }
+            self.write_queue_register(DeviceRegister::TDT, 0, tail);
         }
 
-        let desc = &self.rx[self.rx_idx as usize];
-        if !desc.end_of_packet() {
-            panic!("partial packet\n\x00"); // TODO: Handle?
+        // Wait for the device to read the direct fragments. If it does not,
+        // as when the link is down, drop the frames in flight so the memory
+        // is not read after returning.
+        if direct && !self.tx[0].drain() {
+            unsafe { self.reset_tx_ring(0) };
+            return Err(TxError::Stalled);
         }
 
-        self.rx_idx += 1;
-        if self.rx_idx == self.rx.len() as u32 {
-            self.rx_idx = 0;
+        Ok(())
+    }
+
+    /// Send a batch of frames on transmit queue `queue`, writing the tail
+    /// register once for the whole batch rather than once per frame.
+    fn send_batch(&mut self, queue: usize, bufs: &mut dyn Iterator<Item = PacketBuffer>) -> usize {
+        // A frame takes a data descriptor for each page it spans, plus one if
+        // its checksum context changes. A frame is only taken from `bufs` once
+        // there is room for the largest the MTU allows, and a larger frame
+        // that does not fit is dropped.
+        let max_needed = 1 + (self.mtu as usize + HEADER_LEN).div_ceil(PAGE_SIZE);
+        let ring = &mut self.tx[queue];
+        let mut free = ring.free();
+        let mut queued = 0;
+        while free >= max_needed {
+            let buf = match bufs.next() {
+                Some(x) => x,
+                None => break,
+            };
+            let checksum = buf.tx_checksum();
+            let needed = ring.context_needed(checksum) + buf.len().div_ceil(PAGE_SIZE);
+            if needed > free {
+                break;
+            }
+            free -= needed;
+            let popts = ring.begin(checksum);
+            ring.queue_copy(buf.as_slice(), true, popts);
+            queued += 1;
         }
 
-        unsafe {
-            self.write_register(DeviceRegister::RDT, self.rx_idx - 1);
+        if queued > 0 {
+            let tail = ring.idx;
+            unsafe {
+                self.write_queue_register(DeviceRegister::TDT, queue, tail);
+            }
         }
+        queued
+    }
+
+    /// Read avaliable packets from receive queue `queue`.
+    ///
+    /// Frames are not copied. The page holding the frame is loaned to the
+    /// returned PacketBuffer and a spare page takes its place in the ring.
+    fn recv(&mut self, queue: usize) -> Option<PacketBuffer> {
+        loop {
+            // Find the descriptor holding the end of the next frame. Frames
+            // larger than a receive buffer span several descriptors, and the
+            // device may not have written all of them back yet.
+            let head = unsafe { self.read_queue_register(DeviceRegister::RDH, queue) };
+            let ring = &mut self.rx[queue];
+            let mut idx = ring.idx;
+            let mut count = 0;
+            let checksum = loop {
+                if idx == head {
+                    // Ring buffer is empty, or the frame is incomplete.
+                    return None;
+                }
+                count += 1;
+                let desc = &ring.desc[idx as usize];
+                idx = (idx + 1) % ring.len() as u32;
+                if desc.end_of_packet(ring.extended) {
+                    break desc.checksum(ring.extended);
+                }
+            };
 
-        // 4 bytes removed for ethernet FCS
-        Some(PacketBuffer::new_from_bytes(
-            desc.addr.to_virtual().0 as *const u8,
-            (desc.packet_size() - 4) as usize,
-        ))
+            let mut frame = ring.take();
+            frame.set_rx_checksum(checksum);
+            for _ in 1..count {
+                let segment = ring.take();
+                frame.append(segment);
+            }
+
+            // Return the descriptors to the device.
+            let tail = (ring.idx + ring.len() as u32 - 1) % ring.len() as u32;
+            unsafe {
+                self.write_queue_register(DeviceRegister::RDT, queue, tail);
+            }
+
+            // Drop frames too large for the MTU.
+            if frame.remaining() <= self.mtu as usize + HEADER_LEN {
+                return Some(frame);
+            }
+        }
     }
 }
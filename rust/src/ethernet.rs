@@ -1,5 +1,18 @@
+use crate::ip::Ipv4Addr;
 use crate::packet_buffer::{FromBuffer, ToBuffer};
 
+/// The length of an ethernet header.
+pub const HEADER_LEN: usize = 14;
+
+/// The standard maximum transmission unit, the largest payload of a frame.
+pub const DEFAULT_MTU: u32 = 1500;
+
+/// The largest supported maximum transmission unit, for jumbo frames.
+pub const MAX_MTU: u32 = 9000;
+
+/// The smallest maximum transmission unit an IPv4 host may use.
+pub const MIN_MTU: u32 = 68;
+
 /// An ethernet (MAC) address.
 #[derive(Debug, Copy, Clone, Eq, Ord, PartialEq, PartialOrd)]
 pub struct EthernetAddress([u8; 6]);
@@ -9,6 +22,15 @@ impl EthernetAddress {
         EthernetAddress([buf[0], buf[1], buf[2], buf[3], buf[4], buf[5]])
     }
 
+    /// The ethernet address IPv4 multicast group `addr` is sent to.
+    ///
+    /// RFC1112 Section 6.4
+    /// https://tools.ietf.org/html/rfc1112
+    pub fn from_ipv4_multicast(addr: Ipv4Addr) -> EthernetAddress {
+        let ip = addr.as_bytes();
+        EthernetAddress([0x01, 0x00, 0x5E, ip[1] & 0x7F, ip[2], ip[3]])
+    }
+
     pub fn as_bytes(&self) -> [u8; 6] {
         self.0
     }
@@ -88,8 +110,8 @@ impl EthernetFrame {
     }
 }
 
-impl FromBuffer for EthernetFrame {
-    fn from_buffer(buf: &[u8]) -> Result<EthernetFrame, ()> {
+impl<'a> FromBuffer<'a> for EthernetFrame {
+    fn from_buffer(buf: &'a [u8]) -> Result<EthernetFrame, ()> {
         Ok(EthernetFrame::from_slice(&buf))
     }
 
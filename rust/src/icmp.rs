@@ -1,21 +1,23 @@
-use alloc::vec::Vec;
-
+use crate::ip::{checksum_add, checksum_fold};
 use crate::packet_buffer::{FromBuffer, ToBuffer};
 
 /// Represents an ICMP echo packet.
+///
+/// The data is borrowed from the received packet, so a reply is built
+/// without copying the data until it is serialized.
 #[derive(Debug, Clone)]
-pub struct IcmpEchoMessage {
+pub struct IcmpEchoMessage<'a> {
     pub r#type: Type,
     code: u8,
     checksum: u16,
     identifier: u16,
     sequence_number: u16,
-    data: Vec<u8>,
+    data: &'a [u8],
 }
 
-impl IcmpEchoMessage {
+impl<'a> IcmpEchoMessage<'a> {
     /// Build a new echo response from a request.
-    pub fn from_request(req: IcmpEchoMessage) -> IcmpEchoMessage {
+    pub fn from_request(req: IcmpEchoMessage<'a>) -> IcmpEchoMessage<'a> {
         IcmpEchoMessage {
             r#type: Type::EchoReply,
             code: 0,
@@ -29,8 +31,8 @@ impl IcmpEchoMessage {
 
 /// Represents an ICMP packet.
 #[derive(Debug, Clone)]
-pub enum IcmpPacket {
-    EchoMessage(IcmpEchoMessage),
+pub enum IcmpPacket<'a> {
+    EchoMessage(IcmpEchoMessage<'a>),
 }
 
 #[derive(Debug, Copy, Clone, PartialEq)]
@@ -82,38 +84,35 @@ impl Type {
     }
 }
 
-impl IcmpPacket {
-    pub fn from_slice(buf: &[u8]) -> IcmpPacket {
+impl<'a> IcmpPacket<'a> {
+    /// Parse an ICMP packet, borrowing its data from `buf`. Types other than
+    /// echo messages are not handled.
+    pub fn from_slice(buf: &'a [u8]) -> Result<IcmpPacket<'a>, ()> {
+        if buf.len() < 8 {
+            return Err(());
+        }
         let r#type = Type::from_slice(&buf[0..]);
         match r#type {
-            Type::EchoReply | Type::EchoRequest => IcmpPacket::EchoMessage(IcmpEchoMessage {
+            Type::EchoReply | Type::EchoRequest => Ok(IcmpPacket::EchoMessage(IcmpEchoMessage {
                 r#type: r#type,
                 code: buf[1],
                 checksum: u16::from_be_bytes([buf[2], buf[3]]),
                 identifier: u16::from_be_bytes([buf[4], buf[5]]),
                 sequence_number: u16::from_be_bytes([buf[6], buf[7]]),
-                data: buf[8..].to_vec(),
-            }),
-            _ => panic!("unknown icmp type\n\x00"),
+                data: &buf[8..],
+            })),
+            _ => Err(()),
         }
     }
 
     fn calculate_checksum(buf: &[u8]) -> u16 {
-        let mut sum = 0u32;
-        for i in (0..buf.len()).step_by(2) {
-            let value = u16::from_be_bytes([buf[i], buf[i + 1]]);
-            sum += value as u32;
-        }
-
-        let check = (sum >> 16) + (sum & 0xffff);
-        let check = (check >> 16) + check;
-        !(check as u16)
+        !checksum_fold(checksum_add(0, buf))
     }
 }
 
-impl FromBuffer for IcmpPacket {
-    fn from_buffer(buf: &[u8]) -> Result<IcmpPacket, ()> {
-        Ok(IcmpPacket::from_slice(&buf))
+impl<'a> FromBuffer<'a> for IcmpPacket<'a> {
+    fn from_buffer(buf: &'a [u8]) -> Result<IcmpPacket<'a>, ()> {
+        IcmpPacket::from_slice(buf)
     }
 
     fn size(&self) -> usize {
@@ -124,7 +123,7 @@ impl FromBuffer for IcmpPacket {
     }
 }
 
-impl ToBuffer for IcmpPacket {
+impl<'a> ToBuffer for IcmpPacket<'a> {
     fn to_buffer(&self, buf: &mut [u8]) {
         match self {
             IcmpPacket::EchoMessage(x) => {
@@ -133,7 +132,7 @@ impl ToBuffer for IcmpPacket {
                 buf[2..4].copy_from_slice(&0u16.to_be_bytes());
                 buf[4..6].copy_from_slice(&x.identifier.to_be_bytes());
                 buf[6..8].copy_from_slice(&x.sequence_number.to_be_bytes());
-                buf[8..8 + x.data.len()].copy_from_slice(&x.data[..]);
+                buf[8..8 + x.data.len()].copy_from_slice(x.data);
 
                 let checksum = IcmpPacket::calculate_checksum(&buf[0..8 + x.data.len()]);
                 buf[2..4].copy_from_slice(&(checksum.to_be_bytes()));
@@ -18,6 +18,11 @@ impl Ipv4Addr {
     pub fn as_bytes(&self) -> [u8; 4] {
         self.0
     }
+
+    /// Is this a multicast (224.0.0.0/4) address?
+    pub fn is_multicast(&self) -> bool {
+        self.0[0] & 0xF0 == 0xE0
+    }
 }
 
 impl From<u32> for Ipv4Addr {
@@ -26,6 +31,12 @@ impl From<u32> for Ipv4Addr {
     }
 }
 
+impl From<Ipv4Addr> for u32 {
+    fn from(value: Ipv4Addr) -> u32 {
+        u32::from_be_bytes(value.0)
+    }
+}
+
 #[derive(Debug, Copy, Clone)]
 pub enum Protocol {
     ICMP = 0x01,
@@ -54,6 +65,71 @@ impl Protocol {
     }
 }
 
+/// Add the big endian 16 bit words of `buf` to a ones' complement sum.
+///
+/// An odd trailing byte is padded with zero. The result is partially folded,
+/// so sums can be chained over buffers of up to 64KiB each.
+pub fn checksum_add(sum: u32, buf: &[u8]) -> u32 {
+    let mut sum = (sum & 0xffff) + (sum >> 16);
+    let mut words = buf.chunks_exact(2);
+    for word in &mut words {
+        sum += u16::from_be_bytes([word[0], word[1]]) as u32;
+    }
+    if let [x] = words.remainder() {
+        sum += (*x as u32) << 8;
+    }
+    (sum & 0xffff) + (sum >> 16)
+}
+
+/// A running ones' complement sum over data split into pieces of any
+/// length.
+pub struct Checksum {
+    sum: u32,
+    /// Did the data so far end half way through a word?
+    odd: bool,
+}
+
+impl Checksum {
+    /// Start a sum from `sum`, such as the sum of a pseudo-header.
+    pub fn new(sum: u32) -> Checksum {
+        Checksum { sum, odd: false }
+    }
+
+    /// Add the next piece of data to the sum.
+    pub fn add(&mut self, buf: &[u8]) {
+        let mut buf = buf;
+        if self.odd && !buf.is_empty() {
+            // Complete the word started by the last piece.
+            self.sum = checksum_add(self.sum, &[0, buf[0]]);
+            buf = &buf[1..];
+            self.odd = false;
+        }
+        self.sum = checksum_add(self.sum, buf);
+        self.odd = buf.len() % 2 == 1;
+    }
+
+    /// Is the data, including its checksum field, correctly summed?
+    pub fn valid(&self) -> bool {
+        checksum_fold(self.sum) == 0xffff
+    }
+}
+
+/// Fold a ones' complement sum into 16 bits.
+pub fn checksum_fold(sum: u32) -> u16 {
+    let sum = (sum & 0xffff) + (sum >> 16);
+    ((sum & 0xffff) + (sum >> 16)) as u16
+}
+
+/// The sum of the pseudo-header covered by TCP and UDP checksums.
+///
+/// RFC768
+/// https://tools.ietf.org/html/rfc768
+pub fn pseudo_header_sum(source: Ipv4Addr, dest: Ipv4Addr, protocol: Protocol, len: u16) -> u32 {
+    let mut sum = checksum_add(0, &source.as_bytes());
+    sum = checksum_add(sum, &dest.as_bytes());
+    sum + protocol.as_bytes() as u32 + len as u32
+}
+
 /// An IPv4 packet.
 ///
 /// Represents an IPV4 packet header without options.
@@ -76,6 +152,8 @@ pub struct Ipv4Packet {
     header_checksum: u16,
     source_address: Ipv4Addr,
     destination_address: Ipv4Addr,
+    /// Leave the header checksum for the device to insert.
+    checksum_offload: bool,
 }
 
 impl Ipv4Packet {
@@ -111,11 +189,15 @@ impl Ipv4Packet {
             header_checksum: 0,
             source_address: source_address,
             destination_address: destination_address,
+            checksum_offload: false,
         }
     }
 
     /// Creates a new Ipv4Header from a slice of bytes.
     pub fn from_slice(buf: &[u8]) -> Result<Ipv4Packet, ()> {
+        if buf.len() < 20 {
+            return Err(());
+        }
         let packet = Ipv4Packet {
             version: buf[0] >> 4,
             header_length: buf[0] & 0xf,
@@ -131,10 +213,11 @@ impl Ipv4Packet {
             header_checksum: u16::from_be_bytes([buf[10], buf[11]]),
             source_address: Ipv4Addr::new(buf[12], buf[13], buf[14], buf[15]),
             destination_address: Ipv4Addr::new(buf[16], buf[17], buf[18], buf[19]),
+            checksum_offload: false,
         };
 
-        // Reject any packets with unexpected header lengths.
-        if packet.header_length != 5 {
+        // Reject any packets with unexpected header or total lengths.
+        if packet.header_length != 5 || packet.total_length < 20 {
             return Err(());
         }
         return Ok(packet);
@@ -148,6 +231,50 @@ impl Ipv4Packet {
         self.source_address
     }
 
+    pub fn destination(&self) -> Ipv4Addr {
+        self.destination_address
+    }
+
+    pub fn identification(&self) -> u16 {
+        self.identification
+    }
+
+    /// The length of the data following the header.
+    pub fn data_len(&self) -> usize {
+        self.total_length as usize - 20
+    }
+
+    /// Is this one fragment of a larger datagram?
+    pub fn is_fragment(&self) -> bool {
+        self.mf || self.fragment_offset != 0
+    }
+
+    /// Do more fragments of the datagram follow this one?
+    pub fn more_fragments(&self) -> bool {
+        self.mf
+    }
+
+    /// The offset of the data of this fragment in the datagram, in bytes.
+    pub fn fragment_offset(&self) -> usize {
+        self.fragment_offset as usize * 8
+    }
+
+    /// Check the header checksum of the header at the start of `buf`.
+    pub fn checksum_valid(buf: &[u8]) -> bool {
+        if buf.len() < 20 {
+            return false;
+        }
+        let mut checksum = Checksum::new(0);
+        checksum.add(&buf[..20]);
+        checksum.valid()
+    }
+
+    /// Write the header with a zero checksum, for the device to insert the
+    /// checksum when the packet is sent.
+    pub fn offload_checksum(&mut self) {
+        self.checksum_offload = true;
+    }
+
     /// Write the header to `buf` with the appropriate checksum.
     ///
     /// The header is written to a stack allocated buffer, the checksum
@@ -182,8 +309,8 @@ impl Ipv4Packet {
             &{
                 let mut half = 0u16;
                 half |= (self.df as u16) << 14;
-                half |= (self.mf as u16) << 14;
-                half |= self.fragment_offset & 0x0FFF;
+                half |= (self.mf as u16) << 13;
+                half |= self.fragment_offset & 0x1FFF;
                 half
             }
             .to_be_bytes(),
@@ -201,8 +328,10 @@ impl Ipv4Packet {
         bytes[16..20].copy_from_slice(&self.destination_address.as_bytes());
 
         // Now `bytes` contains the complete header, calculate the checksum.
-        let checksum = &Ipv4Packet::calculate_checksum(&bytes);
-        bytes[10..12].copy_from_slice(&checksum.to_be_bytes());
+        if !self.checksum_offload {
+            let checksum = &Ipv4Packet::calculate_checksum(&bytes);
+            bytes[10..12].copy_from_slice(&checksum.to_be_bytes());
+        }
 
         // Write the temporary buffer.
         buf.copy_from_slice(&bytes);
@@ -213,20 +342,12 @@ impl Ipv4Packet {
     /// RFC791 Section 3.1
     /// https://tools.ietf.org/html/rfc791
     fn calculate_checksum(buf: &[u8]) -> u16 {
-        let mut sum = 0u32;
-        for i in (0..20).step_by(2) {
-            let value = u16::from_be_bytes([buf[i], buf[i + 1]]);
-            sum += value as u32;
-        }
-
-        let check = (sum >> 16) + (sum & 0xffff);
-        let check = (check >> 16) + check;
-        !(check as u16)
+        !checksum_fold(checksum_add(0, &buf[..20]))
     }
 }
 
-impl FromBuffer for Ipv4Packet {
-    fn from_buffer(buf: &[u8]) -> Result<Ipv4Packet, ()> {
+impl<'a> FromBuffer<'a> for Ipv4Packet {
+    fn from_buffer(buf: &'a [u8]) -> Result<Ipv4Packet, ()> {
         Ipv4Packet::from_slice(&buf)
     }
 
@@ -1,8 +1,43 @@
-use crate::kernel::{kalloc, kfree};
+use crate::kernel::{kalloc, kalloc_contig, kfree_contig};
 use crate::mm::PAGE_SIZE;
+use crate::spinlock::Spinlock;
 
 use core::alloc::{GlobalAlloc, Layout};
-use core::ffi::c_void;
+use core::ffi::{c_int, c_void};
+use core::ptr;
+
+/// The smallest size class, 16 bytes, as a power of two. Every object is
+/// large enough to hold the free list link.
+const MIN_CLASS_SHIFT: usize = 4;
+
+/// The largest size class, 2 KiB. Larger allocations take whole pages.
+const MAX_CLASS_SHIFT: usize = 11;
+
+const CLASSES: usize = MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1;
+
+/// The free objects of each size class.
+///
+/// Pages are taken from kalloc() as a class runs out and carved into objects
+/// of the class size, so objects are aligned to their size. Objects are
+/// returned to their class when freed, and pages are never returned to
+/// kalloc().
+static SLABS: [Spinlock<FreeList>; CLASSES] = [EMPTY_SLAB; CLASSES];
+const EMPTY_SLAB: Spinlock<FreeList> = Spinlock::new(FreeList {
+    head: ptr::null_mut(),
+});
+
+/// A free object, linked through its first word.
+struct FreeObject {
+    next: *mut FreeObject,
+}
+
+/// A list of the free objects of a size class.
+struct FreeList {
+    head: *mut FreeObject,
+}
+
+// The free objects are only reached through the slab lock.
+unsafe impl Send for FreeList {}
 
 struct KernelAllocator {}
 
@@ -18,17 +53,96 @@ unsafe impl Sync for KernelAllocator {}
 
 unsafe impl GlobalAlloc for KernelAllocator {
     unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
-        if layout.size() > PAGE_SIZE {
-            panic!("alloc larger than page\n\x00")
-        }
-        let mem = kalloc() as *mut u8;
+        let mem = match class(&layout) {
+            Some(x) => alloc_object(x),
+            None => alloc_pages(&layout),
+        };
         if mem.is_null() {
             panic!("alloc failed\n\x00")
         }
         mem
     }
 
-    unsafe fn dealloc(&self, ptr: *mut u8, _layout: Layout) {
-        kfree(ptr as *const c_void)
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        match class(&layout) {
+            Some(x) => free_object(x, ptr),
+            None => kfree_contig(ptr as *const c_void, pages(&layout)),
+        }
+    }
+
+    /// Objects grow and shrink in place while they stay in the same size
+    /// class or number of pages.
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        let new_layout = Layout::from_size_align_unchecked(new_size, layout.align());
+        let in_place = match (class(&layout), class(&new_layout)) {
+            (Some(a), Some(b)) => a == b,
+            (None, None) => pages(&layout) == pages(&new_layout),
+            _ => false,
+        };
+        if in_place {
+            return ptr;
+        }
+
+        let new_ptr = self.alloc(new_layout);
+        ptr::copy_nonoverlapping(ptr, new_ptr, core::cmp::min(layout.size(), new_size));
+        self.dealloc(ptr, layout);
+        new_ptr
+    }
+}
+
+/// Return the size class of `layout`, or None if it takes whole pages.
+fn class(layout: &Layout) -> Option<usize> {
+    let size = layout.size().max(layout.align()).max(1 << MIN_CLASS_SHIFT);
+    if size > 1 << MAX_CLASS_SHIFT {
+        return None;
+    }
+    Some(size.next_power_of_two().trailing_zeros() as usize - MIN_CLASS_SHIFT)
+}
+
+/// Return the number of pages taken by an allocation too large for a size
+/// class.
+fn pages(layout: &Layout) -> c_int {
+    layout.size().div_ceil(PAGE_SIZE) as c_int
+}
+
+/// Take an object of size class `class`, or null if there is no memory.
+unsafe fn alloc_object(class: usize) -> *mut u8 {
+    let mut slab = SLABS[class].lock();
+    if slab.head.is_null() {
+        // Carve a new page into objects, linked in address order.
+        let page = kalloc() as *mut u8;
+        if page.is_null() {
+            return ptr::null_mut();
+        }
+        let size = 1 << (class + MIN_CLASS_SHIFT);
+        for offset in (0..PAGE_SIZE).step_by(size).rev() {
+            let object = page.add(offset) as *mut FreeObject;
+            (*object).next = slab.head;
+            slab.head = object;
+        }
+    }
+
+    let object = slab.head;
+    slab.head = (*object).next;
+    object as *mut u8
+}
+
+/// Return an object to size class `class`.
+unsafe fn free_object(class: usize, ptr: *mut u8) {
+    let object = ptr as *mut FreeObject;
+    let mut slab = SLABS[class].lock();
+    (*object).next = slab.head;
+    slab.head = object;
+}
+
+/// Take physically contiguous pages for `layout`, or null if there is no run
+/// of free pages large enough.
+unsafe fn alloc_pages(layout: &Layout) -> *mut u8 {
+    if layout.align() > PAGE_SIZE {
+        return ptr::null_mut();
+    }
+    match pages(layout) {
+        1 => kalloc() as *mut u8,
+        n => kalloc_contig(n) as *mut u8,
     }
 }
@@ -1,4 +1,28 @@
-use core::ffi::{c_int, c_uchar, c_void};
+use core::ffi::{c_int, c_uchar, c_uint, c_void};
+
+/// The maximum number of CPUs, which has to match NCPU in param.h.
+pub const NCPU: usize = 8;
+
+/// The xv6 spinlock, see spinlock.h.
+#[repr(C)]
+pub struct CSpinlock {
+    locked: u32,
+    name: *const c_uchar,
+    cpu: *mut c_void,
+    pcs: [u32; 10],
+}
+
+impl CSpinlock {
+    /// Equivalent to initlock(...), usable in a static initializer.
+    pub const fn new(name: &'static [u8]) -> Self {
+        CSpinlock {
+            locked: 0,
+            name: name.as_ptr(),
+            cpu: core::ptr::null_mut(),
+            pcs: [0; 10],
+        }
+    }
+}
 
 // Bindings to the existing xv6 kernel library.
 extern "C" {
@@ -7,16 +31,42 @@ extern "C" {
 
     // console.c
     pub fn cprint(c: *const c_uchar);
+    pub fn cprintf(fmt: *const c_uchar, ...);
 
     // kalloc.c
     pub fn kalloc() -> *mut c_void;
+    pub fn kalloc_contig(n: c_int) -> *mut c_void;
     pub fn kfree(ptr: *const c_void);
+    pub fn kfree_contig(ptr: *const c_void, n: c_int);
+    pub fn kmemstat(refills: *mut c_uint, drains: *mut c_uint, contended: *mut c_uint);
+
+    // vm.c
+    pub fn uva2kva(uva: *const c_uchar) -> *mut c_uchar;
+
+    // proc.c
+    pub fn cpuid() -> c_int;
+    pub fn cpuapicid(n: c_int) -> c_int;
+    pub fn sleep(chan: *const c_void, lk: *mut CSpinlock);
+    pub fn wakeup(chan: *const c_void);
+    pub fn kthread(
+        name: *const c_uchar,
+        func: extern "C" fn(*mut c_void),
+        arg: *mut c_void,
+    ) -> c_int;
+    #[link_name = "yield"]
+    pub fn yield_cpu();
+
+    // trap.c
+    pub static ticks: u32;
 
     // syscall.c
     pub fn argint(n: c_int, ip: *mut c_int);
-    pub fn argptr(n: c_int, pp: *const *mut c_void, size: c_int);
+    pub fn argptr(n: c_int, pp: *const *mut c_void, size: c_int) -> c_int;
+    pub fn fetchptr(addr: c_uint, size: c_int) -> c_int;
 
     // spinlock.c
+    pub fn acquire(lk: *mut CSpinlock);
+    pub fn release(lk: *mut CSpinlock);
     pub fn pushcli();
     pub fn popcli();
 }
@@ -12,16 +12,20 @@ mod kernel;
 mod spinlock;
 
 mod arp;
+mod bench;
 mod cpu;
 mod e1000;
 mod ethernet;
 mod icmp;
 mod ip;
+mod loopback;
 mod mm;
 mod net;
 mod packet_buffer;
 mod pci;
 mod udp;
+mod virtio;
+mod wait;
 
 #[panic_handler]
 fn panic(info: &PanicInfo) -> ! {
@@ -3,6 +3,11 @@
 ///
 /// The facilities provided here are currently fairly minimal until we have
 /// all of the memory management code written in Rust.
+use core::ffi::c_int;
+use core::ops::{Deref, DerefMut};
+use core::{mem, ptr, slice};
+
+use crate::kernel::{kalloc_contig, kfree_contig};
 
 pub const PAGE_SIZE: usize = 1 << 12;
 
@@ -14,7 +19,7 @@ const KERNBASE: u64 = 0x80000000; // First kernel virtual address.
 const _KERNLINK: u64 = KERNBASE + _EXTMEM; // Address where kernel is linked.
 
 /// A physical memory addess.
-#[derive(Debug, Default)]
+#[derive(Debug, Default, Clone, Copy)]
 #[repr(C)]
 pub struct PhysicalAddress(pub u64);
 
@@ -52,3 +57,136 @@ impl VirtualAddress {
         PhysicalAddress(self.0 - KERNBASE)
     }
 }
+
+/// A free list of buffers.
+///
+/// The list is threaded through the first word of each free buffer, in the
+/// same way as the kernel page allocator.
+pub struct FreeList {
+    /// The virtual address of the first free buffer, or zero.
+    head: usize,
+    /// The number of buffers on the list.
+    len: usize,
+}
+
+impl FreeList {
+    pub const fn new() -> Self {
+        FreeList { head: 0, len: 0 }
+    }
+
+    /// The number of buffers on the list.
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    pub fn push(&mut self, buf: *mut u8) {
+        unsafe { *(buf as *mut usize) = self.head };
+        self.head = buf as usize;
+        self.len += 1;
+    }
+
+    pub fn pop(&mut self) -> Option<*mut u8> {
+        if self.head == 0 {
+            return None;
+        }
+        let buf = self.head as *mut u8;
+        self.head = unsafe { *(buf as *const usize) };
+        self.len -= 1;
+        Some(buf)
+    }
+
+    /// Unlink `buf` from the list, returning whether it was found.
+    pub fn remove(&mut self, buf: *mut u8) -> bool {
+        let mut link = &mut self.head as *mut usize;
+        unsafe {
+            while *link != 0 {
+                if *link == buf as usize {
+                    *link = *(buf as *const usize);
+                    self.len -= 1;
+                    return true;
+                }
+                link = *link as *mut usize;
+            }
+        }
+        false
+    }
+}
+
+/// A fixed length array in physically contiguous, page aligned memory.
+///
+/// Used for structures shared with devices, such as descriptor rings, which
+/// the device reads by physical address.
+pub struct ContiguousArray<T> {
+    ptr: *mut T,
+    len: usize,
+}
+
+// The array owns its memory like a Vec does.
+unsafe impl<T: Send> Send for ContiguousArray<T> {}
+unsafe impl<T: Sync> Sync for ContiguousArray<T> {}
+
+impl<T: Default> ContiguousArray<T> {
+    /// Allocate an array of `len` default elements, or None if there is no
+    /// run of free pages large enough.
+    pub fn new(len: usize) -> Option<Self> {
+        let mem = unsafe { kalloc_contig(Self::pages(len)) } as *mut T;
+        if mem.is_null() {
+            return None;
+        }
+        for i in 0..len {
+            unsafe { mem.add(i).write(T::default()) };
+        }
+        Some(ContiguousArray { ptr: mem, len })
+    }
+}
+
+impl<T> ContiguousArray<T> {
+    /// An array with no elements, which owns no memory.
+    pub const fn empty() -> Self {
+        ContiguousArray {
+            ptr: ptr::null_mut(),
+            len: 0,
+        }
+    }
+
+    /// The physical address of the first element.
+    pub fn physical_address(&self) -> PhysicalAddress {
+        PhysicalAddress::from_virtual(self.ptr as u64)
+    }
+
+    fn pages(len: usize) -> c_int {
+        (len * mem::size_of::<T>()).div_ceil(PAGE_SIZE) as c_int
+    }
+}
+
+impl<T> Deref for ContiguousArray<T> {
+    type Target = [T];
+
+    fn deref(&self) -> &[T] {
+        if self.ptr.is_null() {
+            return &[];
+        }
+        unsafe { slice::from_raw_parts(self.ptr, self.len) }
+    }
+}
+
+impl<T> DerefMut for ContiguousArray<T> {
+    fn deref_mut(&mut self) -> &mut [T] {
+        if self.ptr.is_null() {
+            return &mut [];
+        }
+        unsafe { slice::from_raw_parts_mut(self.ptr, self.len) }
+    }
+}
+
+impl<T> Drop for ContiguousArray<T> {
+    fn drop(&mut self) {
+        if self.ptr.is_null() {
+            return;
+        }
+        unsafe {
+            ptr::drop_in_place(self.deref_mut() as *mut [T]);
+            kfree_contig(self.ptr as *const _, Self::pages(self.len));
+        }
+    }
+}
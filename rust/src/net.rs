@@ -1,29 +1,83 @@
 use alloc::boxed::Box;
 use alloc::collections::btree_map::BTreeMap;
+use alloc::collections::VecDeque;
 use alloc::vec;
 use alloc::vec::Vec;
+use core::ffi::c_void;
+use core::ptr;
 use core::slice;
+use core::sync::atomic::{AtomicBool, AtomicPtr, AtomicU16, AtomicU32, AtomicUsize, Ordering};
 
 use crate::arp;
 use crate::arp::{ArpCache, ArpPacket};
 use crate::cpu::{rdtsc, CPU_FREQ_MHZ};
 use crate::e1000::E1000;
-use crate::ethernet::{EthernetAddress, EthernetFrame, Ethertype};
+use crate::ethernet::{EthernetAddress, EthernetFrame, Ethertype, DEFAULT_MTU, HEADER_LEN};
 use crate::icmp::IcmpPacket;
 use crate::icmp::{IcmpEchoMessage, Type};
 use crate::ip::{Ipv4Addr, Ipv4Packet, Protocol};
-use crate::kernel::{argint, argptr, cprint};
-use crate::packet_buffer::{PacketBuffer, BUFFER_SIZE};
+use crate::kernel::{
+    argint, argptr, cprint, fetchptr, kmemstat, kthread, ticks, uva2kva, yield_cpu,
+};
+use crate::loopback::LoopbackDevice;
+use crate::mm::{PhysicalAddress, PAGE_SIZE};
+use crate::packet_buffer::{
+    init_pool, pool_stats, ChecksumStatus, PacketBuffer, RxChecksum, ToBuffer, TxChecksum,
+    BUFFER_SIZE,
+};
+use crate::pci::PciConfig;
 use crate::spinlock::Spinlock;
-use crate::udp::UdpPacket;
+use crate::udp::{UdpPacket, UdpView};
+use crate::virtio::VirtioNet;
+use crate::wait::WaitChannel;
 
-/// The system network device.
-///
-/// Assumptions:
-/// 	- We only have one network device attached to the system
-/// 	- Some driver initialization routine called on system start-up will
-///    register the driver with the network stack.
-static NETWORK_DEVICE: Spinlock<Option<Box<dyn NetworkDevice>>> = Spinlock::new(None);
+/// The maximum number of network interfaces.
+const MAX_INTERFACES: usize = 4;
+
+/// The network interfaces, in the order their devices were found on the PCI
+/// bus. Interfaces are registered on system start-up and never removed, so
+/// the first INTERFACE_COUNT entries are valid for the life of the system.
+static INTERFACES: [AtomicPtr<Interface>; MAX_INTERFACES] = [NO_INTERFACE; MAX_INTERFACES];
+static INTERFACE_COUNT: AtomicUsize = AtomicUsize::new(0);
+const NO_INTERFACE: AtomicPtr<Interface> = AtomicPtr::new(ptr::null_mut());
+
+/// The address given to the first interface on start-up. Interface n is
+/// given 10.0.n.2, on its own /24 network.
+const DEFAULT_ADDRESS: u32 = 0x0A000002;
+const DEFAULT_NETMASK: u32 = 0xFFFFFF00;
+
+/// The address and netmask of the loopback interface.
+const LOOPBACK_ADDRESS: u32 = 0x7F000001;
+const LOOPBACK_NETMASK: u32 = 0xFF000000;
+
+/// The length of the IP and UDP headers on a datagram.
+const UDP_IP_HEADER_LEN: usize = 20 + 8;
+
+/// The most data a single datagram can hold, bounded by the 16 bit IP total
+/// length. Datagrams larger than the MTU are sent as IP fragments.
+const MAX_DATAGRAM: usize = 65535 - UDP_IP_HEADER_LEN;
+
+/// The identification of the next datagram sent as fragments.
+static FRAGMENT_ID: AtomicU16 = AtomicU16::new(1);
+
+/// The most datagrams being reassembled at once, the most fragments held for
+/// one datagram, and how long, in timer ticks, a datagram waits for its
+/// missing fragments before it is dropped.
+const REASSEMBLY_SLOTS: usize = 8;
+const REASSEMBLY_FRAGMENTS: usize = 64;
+const REASSEMBLY_TIMEOUT: u32 = 300;
+
+/// Datagrams being reassembled from IP fragments, oldest first.
+static REASSEMBLY: Spinlock<Vec<Reassembly>> = Spinlock::new(Vec::new());
+
+/// The maximum number of received datagrams queued on a socket.
+const RECV_QUEUE_LEN: usize = 32;
+
+/// The maximum number of frames queued before they are sent as a batch.
+const TX_BATCH: usize = 32;
+
+/// The maximum number of frames handled in a single pass of the poller.
+const POLL_BUDGET: usize = 64;
 
 /// ARP Cache.
 static ARP_CACHE: Spinlock<ArpCache> = Spinlock::new(ArpCache::new());
@@ -31,25 +85,378 @@ static ARP_CACHE: Spinlock<ArpCache> = Spinlock::new(ArpCache::new());
 /// Active system sockets.
 static SOCKETS: Spinlock<BTreeMap<usize, Socket>> = Spinlock::new(BTreeMap::new());
 
+/// The maximum number of receive and transmit queue pairs used on a device.
+/// Each receive queue has its own network thread.
+pub const MAX_QUEUES: usize = 2;
+
+/// The names of the network threads.
+const NETD_NAMES: [&[u8]; MAX_QUEUES] = [b"netd0\x00", b"netd1\x00"];
+
+/// The network thread of each receive queue waits here for the interrupt
+/// handler to schedule it.
+static NETD_WAIT: [WaitChannel; MAX_QUEUES] = [
+    WaitChannel::new(NETD_NAMES[0]),
+    WaitChannel::new(NETD_NAMES[1]),
+];
+
+/// Processes waiting for free transmit descriptors.
+static TX_WAIT: WaitChannel = WaitChannel::new(b"nettx\x00");
+
+/// Count of wakeups on `TX_WAIT`, so a sender can tell whether descriptors
+/// were freed since it last found the ring full.
+static TX_WAKEUPS: AtomicU32 = AtomicU32::new(0);
+
+/// Sleep until descriptors are freed after the wakeup count `seen`.
+///
+/// The count is checked under the channel lock, which `wake` also takes, so a
+/// wakeup between the failed send and the sleep is not lost.
+fn wait_for_tx(seen: u32) {
+    TX_WAIT.wait_until(|| (TX_WAKEUPS.load(Ordering::Acquire) != seen).then_some(()));
+}
+
 /// Represents a device that can send and receive packets.
 pub trait NetworkDevice: Send + Sync {
     /// The hardware (MAC) address of the device.
     fn hardware_address(&self) -> EthernetAddress;
 
-    /// The protocol (IP) address of the device.
-    fn protocol_address(&self) -> Ipv4Addr;
+    /// The number of receive and transmit queue pairs in use, at most
+    /// MAX_QUEUES.
+    fn queues(&self) -> usize;
+
+    /// Return the current value of a device parameter, or None if the device
+    /// does not support it.
+    fn parameter(&self, param: DeviceParameter) -> Option<u32>;
+
+    /// Set a device parameter.
+    fn set_parameter(&mut self, param: DeviceParameter, value: u32) -> Result<(), ()>;
+
+    /// Receive frames sent to the multicast address `addr`.
+    ///
+    /// Joins are counted, and the address is received until it has been left
+    /// as many times as it was joined.
+    fn join_multicast(&mut self, addr: EthernetAddress);
+
+    /// Stop receiving frames sent to the multicast address `addr`.
+    fn leave_multicast(&mut self, addr: EthernetAddress);
+
+    /// The work the device can take over from the network stack.
+    fn offload(&self) -> Offload;
+
+    /// Return the device statistics counted since start-up.
+    fn stats(&mut self) -> DeviceStats;
+
+    /// Clear interrupts, reporting what the device raised them for.
+    ///
+    /// `vector` is the MSI-X vector raised, numbered from zero, or None for
+    /// the legacy interrupt.
+    fn clear_interrupts(&mut self, vector: Option<usize>) -> InterruptStatus;
+
+    /// Mask receive interrupts of a queue while the poller drains it.
+    fn disable_rx_interrupts(&mut self, queue: usize);
+
+    /// Unmask receive interrupts of a queue once the poller has drained it.
+    ///
+    /// Returns true if frames arrived while interrupts were masked that will
+    /// not raise an interrupt of their own, so the poller must run again.
+    fn enable_rx_interrupts(&mut self, queue: usize) -> bool;
+
+    /// Does the device receive the frames sent on it, without raising an
+    /// interrupt? The poller of the first queue is scheduled after sending.
+    fn loopback(&self) -> bool {
+        false
+    }
+
+    /// Serialize a new packet on the first transmit queue.
+    fn send(&mut self, buf: PacketBuffer) -> Result<(), TxError>;
+
+    /// Serialize a new packet from a header and a list of payload fragments.
+    ///
+    /// The fragments are sent in order after the contents of `header` as a
+    /// single frame. Either the whole frame is queued or none of it is.
+    fn send_gather(&mut self, header: PacketBuffer, payload: &[TxFragment]) -> Result<(), TxError>;
+
+    /// Serialize a batch of new packets on a transmit queue.
+    ///
+    /// Devices should notify the hardware once for the whole batch. Packets
+    /// are only taken from `bufs` while there is room for a frame at the MTU,
+    /// and the number of packets sent is returned. A larger packet taken
+    /// without room for it is dropped.
+    fn send_batch(&mut self, queue: usize, bufs: &mut dyn Iterator<Item = PacketBuffer>) -> usize;
+
+    /// Receive a new packet from a receive queue.
+    fn recv(&mut self, queue: usize) -> Option<PacketBuffer>;
+}
+
+/// Tunable device parameters, see the NETCTL_ values in net.h.
+#[derive(Debug, Copy, Clone)]
+pub enum DeviceParameter {
+    /// Minimum interval between interrupts, in 256ns units.
+    InterruptThrottle,
+    /// Delay after a frame is received before interrupting, in 1.024us units.
+    /// Restarted by each frame received.
+    RxDelay,
+    /// Maximum delay after a frame is received before interrupting, in
+    /// 1.024us units.
+    RxAbsoluteDelay,
+    /// The largest frame payload sent or received, in bytes.
+    Mtu,
+    /// Receive all frames, not only those for the device (1), or not (0).
+    Promiscuous,
+    /// The number of receive descriptors.
+    RxRingSize,
+    /// The number of transmit descriptors.
+    TxRingSize,
+}
+
+impl DeviceParameter {
+    fn from_ctl(param: i32) -> Option<DeviceParameter> {
+        match param {
+            1 => Some(DeviceParameter::InterruptThrottle),
+            2 => Some(DeviceParameter::RxDelay),
+            3 => Some(DeviceParameter::RxAbsoluteDelay),
+            4 => Some(DeviceParameter::Mtu),
+            5 => Some(DeviceParameter::Promiscuous),
+            6 => Some(DeviceParameter::RxRingSize),
+            7 => Some(DeviceParameter::TxRingSize),
+            _ => None,
+        }
+    }
+}
+
+/// A network device and the stack state kept for it.
+pub struct Interface {
+    /// The index of the interface, in the order it was registered.
+    index: usize,
+    device: Spinlock<Box<dyn NetworkDevice>>,
+    /// The protocol (IP) address and netmask, in host byte order.
+    address: AtomicU32,
+    netmask: AtomicU32,
+    stats: Spinlock<NetStats>,
+    /// Set when a receive queue has frames waiting and its receive interrupts
+    /// are masked until the poller has drained it.
+    poll_pending: [AtomicBool; MAX_QUEUES],
+}
+
+impl Interface {
+    /// The protocol address of the interface.
+    fn address(&self) -> Ipv4Addr {
+        Ipv4Addr::from(self.address.load(Ordering::Relaxed))
+    }
+
+    /// Is `addr` on the network the interface is attached to?
+    fn on_link(&self, addr: Ipv4Addr) -> bool {
+        let netmask = self.netmask.load(Ordering::Relaxed);
+        (u32::from(addr) ^ self.address.load(Ordering::Relaxed)) & netmask == 0
+    }
+}
+
+/// Interface configuration, see struct ifconfig in net.h.
+#[repr(C)]
+struct IfConfig {
+    address: u32,
+    netmask: u32,
+    mac: [u8; 6],
+    stats: NetStats,
+}
+
+/// Network stack counters, see struct netstat in net.h.
+#[repr(C)]
+#[derive(Debug, Copy, Clone)]
+pub struct NetStats {
+    /// Device interrupts handled.
+    interrupts: u32,
+    /// Frames received.
+    rx_packets: u32,
+    /// Frames sent.
+    tx_packets: u32,
+    /// Replies dropped for lack of transmit descriptors.
+    tx_dropped: u32,
+    /// Receiver overruns, where the receive ring was full.
+    rx_overruns: u32,
+    /// Frames lost by the device for lack of receive descriptors.
+    rx_missed: u32,
+    /// Buffers in the packet buffer pool. The pool counters are system wide,
+    /// and only reported by sys_netstat.
+    pool_buffers: u32,
+    /// Pool buffers in use.
+    pool_in_use: u32,
+    /// Times the pool ran dry and grew.
+    pool_misses: u32,
+    /// CPU page caches refilled from the shared free list. The page
+    /// allocator counters are system wide, and only reported by sys_netstat.
+    kmem_refills: u32,
+    /// CPU page caches drained to the shared free list.
+    kmem_drains: u32,
+    /// Shared free list lock acquisitions that had to wait.
+    kmem_contended: u32,
+}
+
+impl NetStats {
+    const fn new() -> Self {
+        NetStats {
+            interrupts: 0,
+            rx_packets: 0,
+            tx_packets: 0,
+            tx_dropped: 0,
+            rx_overruns: 0,
+            rx_missed: 0,
+            pool_buffers: 0,
+            pool_in_use: 0,
+            pool_misses: 0,
+            kmem_refills: 0,
+            kmem_drains: 0,
+            kmem_contended: 0,
+        }
+    }
+
+    /// Accumulate the counters in `other`.
+    fn add(&mut self, other: &NetStats) {
+        self.interrupts += other.interrupts;
+        self.rx_packets += other.rx_packets;
+        self.tx_packets += other.tx_packets;
+        self.tx_dropped += other.tx_dropped;
+        self.rx_overruns += other.rx_overruns;
+        self.rx_missed += other.rx_missed;
+    }
+}
+
+/// Work a device can take over from the network stack.
+#[derive(Debug, Default, Copy, Clone)]
+pub struct Offload {
+    /// Inserting IPv4 header checksums on transmit.
+    pub tx_ip_checksum: bool,
+    /// Inserting UDP checksums on transmit.
+    pub tx_udp_checksum: bool,
+}
+
+/// Statistics counted by a network device, see struct netdevstat in net.h.
+///
+/// Devices leave counters they do not keep at zero.
+#[repr(C)]
+#[derive(Debug, Default, Copy, Clone)]
+pub struct DeviceStats {
+    /// Frames received, including bad frames.
+    pub rx_packets: u64,
+    /// Good frames received.
+    pub rx_good_packets: u64,
+    /// Good broadcast frames received.
+    pub rx_broadcast: u64,
+    /// Good multicast frames received.
+    pub rx_multicast: u64,
+    /// Bytes received, including bad frames.
+    pub rx_bytes: u64,
+    /// Bytes received in good frames.
+    pub rx_good_bytes: u64,
+    /// Frames received with a CRC error.
+    pub rx_crc_errors: u64,
+    /// Frames received with another receive error.
+    pub rx_errors: u64,
+    /// Frames dropped because the receive FIFO was full.
+    pub rx_missed: u64,
+    /// Times a frame arrived with no free receive descriptor.
+    pub rx_no_buffers: u64,
+    /// Frames received shorter than the minimum frame size.
+    pub rx_undersize: u64,
+    /// Frames received longer than the maximum frame size.
+    pub rx_oversize: u64,
+    /// Frames sent, including failed frames.
+    pub tx_packets: u64,
+    /// Frames sent successfully.
+    pub tx_good_packets: u64,
+    /// Bytes sent, including failed frames.
+    pub tx_bytes: u64,
+    /// Bytes sent in successful frames.
+    pub tx_good_bytes: u64,
+    /// Collisions seen while sending.
+    pub collisions: u64,
+}
+
+/// The events a device raised an interrupt for.
+#[derive(Debug, Default)]
+pub struct InterruptStatus {
+    /// Transmit descriptors were completed and reclaimed.
+    pub tx_done: bool,
+    /// The receive queues frames were received on, one bit per queue.
+    pub rx_queues: u32,
+    /// The receive ring was full and frames were lost.
+    pub rx_overrun: bool,
+    /// The number of frames lost since last reported.
+    pub rx_missed: u32,
+}
+
+impl InterruptStatus {
+    /// Did the device raise the interrupt at all?
+    fn raised(&self) -> bool {
+        self.tx_done || self.rx_queues != 0 || self.rx_overrun || self.rx_missed != 0
+    }
+}
+
+/// The addresses of an interface, copied out so received frames can be
+/// handled without holding the device lock.
+#[derive(Debug, Copy, Clone)]
+struct InterfaceAddresses {
+    index: usize,
+    hardware: EthernetAddress,
+    protocol: Ipv4Addr,
+}
+
+impl InterfaceAddresses {
+    fn new(interface: &Interface, device: &Box<dyn NetworkDevice>) -> Self {
+        InterfaceAddresses {
+            index: interface.index,
+            hardware: device.hardware_address(),
+            protocol: interface.address(),
+        }
+    }
+}
 
-    /// Set the protocol address of the device.
-    fn set_protocol_address(&mut self, protocol_address: Ipv4Addr);
+/// Errors reported by a device when transmitting.
+#[derive(Debug)]
+pub enum TxError {
+    /// There are not enough free transmit descriptors for the frame. Retry
+    /// once the device has completed some of the frames in flight.
+    RingFull,
+    /// The device did not send a frame reading memory in place in time, as
+    /// when the link is down, so the frame was dropped.
+    Stalled,
+}
 
-    /// Clear interrupts.
-    fn clear_interrupts(&mut self);
+/// Errors reported by the socket layer.
+#[derive(Debug)]
+enum SocketError {
+    /// No such socket, or the socket is not set up for the operation.
+    Invalid,
+    /// The operation cannot complete without blocking.
+    WouldBlock,
+}
 
-    /// Serialize a new packet.
-    fn send(&mut self, buf: PacketBuffer);
+impl From<TxError> for SocketError {
+    fn from(err: TxError) -> Self {
+        match err {
+            TxError::RingFull => SocketError::WouldBlock,
+            TxError::Stalled => SocketError::Invalid,
+        }
+    }
+}
 
-    /// Receive a new packet.
-    fn recv(&mut self) -> Option<PacketBuffer>;
+/// A piece of the payload of a frame to be transmitted.
+pub enum TxFragment<'a> {
+    /// Data copied by the device into its own transmit buffers.
+    Copy(&'a [u8]),
+    /// Physically contiguous memory read by the device directly. The memory
+    /// must stay valid until `send_gather` returns, which does not happen
+    /// until the device has read it or the frame has been dropped.
+    Direct(PhysicalAddress, usize),
+}
+
+impl<'a> TxFragment<'a> {
+    /// Return the number of bytes in the fragment.
+    pub fn len(&self) -> usize {
+        match self {
+            TxFragment::Copy(x) => x.len(),
+            TxFragment::Direct(_, len) => *len,
+        }
+    }
 }
 
 #[derive(Debug)]
@@ -58,8 +465,35 @@ enum SocketType {
     UDP,
 }
 
+/// A message passed to the sendmmsg system call.
+#[repr(C)]
+struct MMsg {
+    /// The message data.
+    buf: *const u8,
+    /// The length of the message data.
+    len: i32,
+}
+
+/// The addressing used to send datagrams on a connected socket.
+#[derive(Debug, Copy, Clone)]
+struct Route {
+    interface: usize,
+    source_port: u16,
+    source_address: Ipv4Addr,
+    dest_port: u16,
+    dest_protocol_address: Ipv4Addr,
+    dest_hardware_address: EthernetAddress,
+}
+
+/// A received datagram waiting on a socket.
+struct Datagram {
+    /// The received frame, parsed up to the start of the datagram data.
+    buf: PacketBuffer,
+    /// The length of the datagram data.
+    len: usize,
+}
+
 /// Represents one end of a socket connection.
-#[derive(Debug)]
 struct Socket {
     r#type: SocketType,
     source_port: Option<u16>,
@@ -67,28 +501,70 @@ struct Socket {
     dest_port: Option<u16>,
     dest_protocol_address: Option<Ipv4Addr>,
     dest_hardware_address: Option<EthernetAddress>,
-    buffer: Vec<u8>,
+    /// The interface datagrams are received on and sent from, or None for
+    /// every interface.
+    interface: Option<usize>,
+    /// The multicast group joined by binding to it.
+    multicast_group: Option<Ipv4Addr>,
+    buffer: VecDeque<Datagram>,
+}
+
+impl Socket {
+    /// Return the addressing for datagrams sent on the socket, if it has been
+    /// set up with connect(...).
+    fn route(&self) -> Result<Route, SocketError> {
+        match (
+            self.interface,
+            self.source_port,
+            self.source_address,
+            self.dest_port,
+            self.dest_protocol_address,
+            self.dest_hardware_address,
+        ) {
+            (Some(i), Some(a), Some(b), Some(c), Some(d), Some(e)) => Ok(Route {
+                interface: i,
+                source_port: a,
+                source_address: b,
+                dest_port: c,
+                dest_protocol_address: d,
+                dest_hardware_address: e,
+            }),
+            _ => Err(SocketError::Invalid),
+        }
+    }
 }
 
 /// Initialize the network stack.
 ///
 /// Called on system start-up to initialize the kernel network stack. Routine
-/// searches for a compatible E1000 family network device and registers that
-/// device in the `NETWORK_DEVICE` global.
+/// registers an interface for every supported network device on the PCI bus,
+/// each with its default address, followed by the loopback interface.
 #[no_mangle]
 unsafe extern "C" fn rustnetinit() {
-    // Setup the network device and panic if no device is avaliable.
-    let e1000_device = match E1000::new() {
-        Some(x) => x,
-        None => panic!("no network device\n\x00"),
-    };
-    cprint("Configured E1000 family device\n\x00".as_ptr());
+    init_pool();
 
-    // Assign a hardcoded, static IP to the device for now.
-    let mut network_device = NETWORK_DEVICE.lock();
-    let mut device = Box::new(e1000_device);
-    device.set_protocol_address(Ipv4Addr::from(0x0A000002 as u32));
-    *network_device = Some(device);
+    // Setup the network devices, leaving room for the loopback interface.
+    for config in PciConfig::devices() {
+        if INTERFACE_COUNT.load(Ordering::Relaxed) == MAX_INTERFACES - 1 {
+            break;
+        }
+        let device: Box<dyn NetworkDevice> = if let Some(x) = E1000::new(&config) {
+            cprint("Configured E1000 family device\n\x00".as_ptr());
+            Box::new(x)
+        } else if let Some(x) = VirtioNet::new(&config) {
+            cprint("Configured virtio network device\n\x00".as_ptr());
+            Box::new(x)
+        } else {
+            continue;
+        };
+        let index = INTERFACE_COUNT.load(Ordering::Relaxed) as u32;
+        register_interface(device, DEFAULT_ADDRESS + (index << 8), DEFAULT_NETMASK);
+    }
+    register_interface(
+        Box::new(LoopbackDevice::new()),
+        LOOPBACK_ADDRESS,
+        LOOPBACK_NETMASK,
+    );
 
     // Setup other buffers and caches.
     let mut sockets = SOCKETS.lock();
@@ -96,12 +572,117 @@ unsafe extern "C" fn rustnetinit() {
 
     let mut arp_cache = ARP_CACHE.lock();
     *arp_cache = ArpCache::new();
+    drop(arp_cache);
+    drop(sockets);
+}
+
+/// Start the network threads.
+///
+/// Called on system start-up after the first user process is created, so
+/// init keeps pid 1 and the threads have it as their parent. A thread runs
+/// the protocol stack for each receive queue, polling that queue on every
+/// interface.
+#[no_mangle]
+unsafe extern "C" fn rustnetstart() {
+    let queues = interfaces()
+        .map(|x| x.device.lock().queues())
+        .max()
+        .unwrap_or(1);
+    for queue in 0..queues {
+        let name = NETD_NAMES[queue].as_ptr();
+        if kthread(name, netd, queue as *mut c_void) < 0 {
+            panic!("cannot start netd\n\x00");
+        }
+    }
+}
+
+/// Register `device` as the next interface, with the address and netmask
+/// given.
+///
+/// Only called on start-up, before the network threads run.
+fn register_interface(device: Box<dyn NetworkDevice>, address: u32, netmask: u32) {
+    let index = INTERFACE_COUNT.load(Ordering::Relaxed);
+    let interface = Box::new(Interface {
+        index,
+        device: Spinlock::new(device),
+        address: AtomicU32::new(address),
+        netmask: AtomicU32::new(netmask),
+        stats: Spinlock::new(NetStats::new()),
+        poll_pending: [AtomicBool::new(false), AtomicBool::new(false)],
+    });
+    INTERFACES[index].store(Box::into_raw(interface), Ordering::Release);
+    INTERFACE_COUNT.store(index + 1, Ordering::Release);
+}
+
+/// Return the interface with index `index`, if there is one.
+fn interface(index: usize) -> Option<&'static Interface> {
+    if index >= INTERFACE_COUNT.load(Ordering::Acquire) {
+        return None;
+    }
+    unsafe { INTERFACES[index].load(Ordering::Acquire).as_ref() }
+}
+
+/// Return an iterator over the interfaces.
+fn interfaces() -> impl Iterator<Item = &'static Interface> {
+    (0..INTERFACE_COUNT.load(Ordering::Acquire)).filter_map(interface)
+}
+
+/// Return the interface to reach `addr` from: the first interface on the
+/// same network, otherwise the first interface.
+fn route_interface(addr: Ipv4Addr) -> Option<&'static Interface> {
+    interfaces()
+        .find(|x| x.on_link(addr))
+        .or_else(|| interface(0))
+}
+
+/// Schedule the poller of the first queue of `interface` if its device
+/// receives the frames sent on it, as no interrupt will. Called once the
+/// device lock is released after sending.
+fn poll_loopback(interface: &Interface, loopback: bool) {
+    if loopback {
+        interface.poll_pending[0].store(true, Ordering::Release);
+        NETD_WAIT[0].wake();
+    }
 }
 
 /// Entrypoint for network device interrupts.
+///
+/// Devices may share the legacy interrupt line, so every interface is asked
+/// whether it raised the interrupt.
 #[no_mangle]
 unsafe extern "C" fn netintr() {
-    handle_interrupt();
+    for interface in interfaces() {
+        handle_interrupt(interface, None);
+    }
+}
+
+/// Entrypoint for network device MSI-X interrupts, numbered from zero.
+#[no_mangle]
+unsafe extern "C" fn netintrvec(vector: i32) {
+    for interface in interfaces() {
+        handle_interrupt(interface, Some(vector as usize));
+    }
+}
+
+/// The network kernel thread of the receive queue passed as its argument.
+///
+/// Sleeps until the interrupt handler schedules the poller of the queue on
+/// any interface, then runs polling passes until the queues are drained. The
+/// thread yields between passes so a flood of frames cannot starve other
+/// processes.
+extern "C" fn netd(arg: *mut c_void) {
+    let queue = arg as usize;
+    loop {
+        NETD_WAIT[queue].wait_until(|| {
+            interfaces()
+                .any(|x| x.poll_pending[queue].load(Ordering::Acquire))
+                .then_some(())
+        });
+        for interface in interfaces() {
+            poll(interface, queue, POLL_BUDGET);
+        }
+        unsafe { yield_cpu() };
+    }
 }
 
 /// The socket system call.
@@ -182,17 +763,32 @@ unsafe extern "C" fn sys_send() -> i32 {
     let mut socket_id: i32 = 0;
     argint(0, &mut socket_id);
 
-    let mut data: *mut u8 = core::ptr::null_mut();
-    let data_ptr: *const *mut u8 = &mut data;
-    argptr(1, data_ptr as _, 4);
-
+    // Check the whole of the data lies in user memory, as it may be sent as
+    // many fragments.
     let mut len: i32 = 0;
     argint(2, &mut len);
-    let len = len as usize;
 
-    let data = unsafe { slice::from_raw_parts(data, len) };
+    let mut data: *mut u8 = core::ptr::null_mut();
+    let data_ptr: *const *mut u8 = &mut data;
+    if argptr(1, data_ptr as _, len) < 0 {
+        return -1;
+    }
+
+    let data = unsafe { slice::from_raw_parts(data, len as usize) };
+
+    // Sleep until the device has room for the datagram. A datagram sent as
+    // fragments carries on from the fragment that did not fit. The send runs
+    // outside the wait channel lock, as it may wait for the device.
+    let mut progress = FragmentProgress::default();
+    let result = loop {
+        let seen = TX_WAKEUPS.load(Ordering::Acquire);
+        match send(socket_id as u32, &data, &mut progress) {
+            Err(SocketError::WouldBlock) => wait_for_tx(seen),
+            x => break x,
+        }
+    };
 
-    match send(socket_id as u32, &data) {
+    match result {
         Ok(n) => match i32::try_from(n) {
             Ok(n) => n,
             Err(_) => {
@@ -205,6 +801,51 @@ unsafe extern "C" fn sys_send() -> i32 {
     }
 }
 
+/// The sendmmsg system call.
+///
+/// Send a number of messages on a socket, one datagram per message. The
+/// messages are handed to the network device as a single batch. Returns the
+/// number of messages sent.
+#[no_mangle]
+unsafe extern "C" fn sys_sendmmsg() -> i32 {
+    let mut socket_id: i32 = 0;
+    argint(0, &mut socket_id);
+
+    let mut vlen: i32 = 0;
+    argint(2, &mut vlen);
+    if vlen < 0 || vlen > i32::MAX / core::mem::size_of::<MMsg>() as i32 {
+        return -1;
+    }
+
+    let mut msgs: *mut MMsg = core::ptr::null_mut();
+    let msgs_ptr: *const *mut MMsg = &mut msgs;
+    argptr(1, msgs_ptr as _, vlen * core::mem::size_of::<MMsg>() as i32);
+    if msgs.is_null() {
+        return -1;
+    }
+
+    // The messages point at user memory too, so check every one before any
+    // is sent.
+    let msgs = slice::from_raw_parts(msgs, vlen as usize);
+    for msg in msgs {
+        if fetchptr(msg.buf as u32, msg.len) < 0 {
+            return -1;
+        }
+    }
+
+    // Sleep whenever the device has no room for the next message.
+    let mut sent = 0;
+    while sent < msgs.len() {
+        let seen = TX_WAKEUPS.load(Ordering::Acquire);
+        match sendmmsg(socket_id as u32, &msgs[sent..]) {
+            Ok(0) | Err(SocketError::WouldBlock) => wait_for_tx(seen),
+            Ok(n) => sent += n as usize,
+            Err(_) => return -1,
+        }
+    }
+    sent as i32
+}
+
 /// The recv system call.
 #[no_mangle]
 unsafe extern "C" fn sys_recv() -> i32 {
@@ -239,12 +880,133 @@ unsafe extern "C" fn sys_shutdown() -> i32 {
     }
 }
 
+/// The netctl system call.
+///
+/// Set a parameter of the first network device, one of the NETCTL_ values in
+/// net.h, to `value`. A negative value leaves the parameter unchanged. Returns
+/// the current value of the parameter.
+#[no_mangle]
+unsafe extern "C" fn sys_netctl() -> i32 {
+    let mut param: i32 = 0;
+    argint(0, &mut param);
+
+    let mut value: i32 = 0;
+    argint(1, &mut value);
+
+    let param = match DeviceParameter::from_ctl(param) {
+        Some(x) => x,
+        None => return -1,
+    };
+
+    let mut device = match interface(0) {
+        Some(x) => x.device.lock(),
+        None => return -1,
+    };
+
+    if value >= 0 && device.set_parameter(param, value as u32).is_err() {
+        return -1;
+    }
+    match device.parameter(param) {
+        Some(x) => x as i32,
+        None => -1,
+    }
+}
+
+/// The netstat system call.
+///
+/// Copy the network stack counters, summed over every interface, and the
+/// packet buffer pool and page allocator counters to a user struct netstat.
+#[no_mangle]
+unsafe extern "C" fn sys_netstat() -> i32 {
+    let mut stats: *mut NetStats = core::ptr::null_mut();
+    let stats_ptr: *const *mut NetStats = &mut stats;
+    argptr(0, stats_ptr as _, core::mem::size_of::<NetStats>() as i32);
+    if stats.is_null() {
+        return -1;
+    }
+
+    let mut total = NetStats::new();
+    for interface in interfaces() {
+        total.add(&interface.stats.lock());
+    }
+    (total.pool_buffers, total.pool_in_use, total.pool_misses) = pool_stats();
+    kmemstat(
+        &mut total.kmem_refills,
+        &mut total.kmem_drains,
+        &mut total.kmem_contended,
+    );
+    *stats = total;
+    0
+}
+
+/// The netdevstat system call.
+///
+/// Copy the statistics of the first network device to a user struct
+/// netdevstat.
+#[no_mangle]
+unsafe extern "C" fn sys_netdevstat() -> i32 {
+    let mut stats: *mut DeviceStats = core::ptr::null_mut();
+    let stats_ptr: *const *mut DeviceStats = &mut stats;
+    argptr(
+        0,
+        stats_ptr as _,
+        core::mem::size_of::<DeviceStats>() as i32,
+    );
+    if stats.is_null() {
+        return -1;
+    }
+
+    let mut device = match interface(0) {
+        Some(x) => x.device.lock(),
+        None => return -1,
+    };
+    *stats = device.stats();
+    0
+}
+
+/// The ifconfig system call.
+///
+/// Copy the configuration of interface `index` to a user struct ifconfig.
+/// If `set` is non-zero, the address and netmask of the interface are first
+/// set from the struct. Returns -1 if there is no such interface.
+#[no_mangle]
+unsafe extern "C" fn sys_ifconfig() -> i32 {
+    let mut index: i32 = 0;
+    argint(0, &mut index);
+
+    let mut conf: *mut IfConfig = core::ptr::null_mut();
+    let conf_ptr: *const *mut IfConfig = &mut conf;
+    argptr(1, conf_ptr as _, core::mem::size_of::<IfConfig>() as i32);
+
+    let mut set: i32 = 0;
+    argint(2, &mut set);
+
+    if index < 0 || conf.is_null() {
+        return -1;
+    }
+    let interface = match interface(index as usize) {
+        Some(x) => x,
+        None => return -1,
+    };
+
+    if set != 0 {
+        interface.address.store((*conf).address, Ordering::Relaxed);
+        interface.netmask.store((*conf).netmask, Ordering::Relaxed);
+    }
+    *conf = IfConfig {
+        address: interface.address.load(Ordering::Relaxed),
+        netmask: interface.netmask.load(Ordering::Relaxed),
+        mac: interface.device.lock().hardware_address().as_bytes(),
+        stats: *interface.stats.lock(),
+    };
+    0
+}
+
 /// Create a new socket of the specified domain and return the socket identifer.
 fn create_socket(domain: SocketType) -> u32 {
     let mut sockets = SOCKETS.lock();
     let socket_id = sockets.len();
-    let mut buffer = vec::Vec::<u8>::new();
-    buffer.reserve(BUFFER_SIZE);
+    let buffer = VecDeque::with_capacity(RECV_QUEUE_LEN);
     sockets.insert(
         socket_id,
         Socket {
@@ -254,6 +1016,8 @@ fn create_socket(domain: SocketType) -> u32 {
             dest_port: None,
             dest_protocol_address: None,
             dest_hardware_address: None,
+            interface: None,
+            multicast_group: None,
             buffer: buffer,
         },
     );
@@ -262,31 +1026,73 @@ fn create_socket(domain: SocketType) -> u32 {
 
 /// Bind a socket to a local address and port.
 ///
-/// TODO:
-/// 	- Don't hardcode address to 10.0.0.2
-fn bind(socket_id: u32, _source_address: u32, source_port: u16) -> Result<(), ()> {
+/// The socket receives on the interface with the address, or on every
+/// interface if the address is zero. Binding to a multicast address joins the
+/// group on every interface, so datagrams sent to the group on the port are
+/// received by the socket.
+fn bind(socket_id: u32, source_address: u32, source_port: u16) -> Result<(), ()> {
+    let source_address = Ipv4Addr::from(source_address);
+    let interface = if source_address.is_multicast() || source_address == Ipv4Addr::from(0) {
+        None
+    } else {
+        match interfaces().find(|x| x.address() == source_address) {
+            Some(x) => Some(x.index),
+            None => return Err(()),
+        }
+    };
+
     let mut sockets = SOCKETS.lock();
     let mut socket = match sockets.get_mut(&(socket_id as usize)) {
         Some(x) => x,
         None => return Err(()),
     };
+    if socket.multicast_group.is_some() {
+        return Err(());
+    }
 
     socket.source_port = Some(source_port);
-    socket.source_address = Some(Ipv4Addr::from(0x0A000002 as u32));
+    socket.interface = interface;
+    socket.source_address = interface.map(|_| source_address);
+    if !source_address.is_multicast() {
+        return Ok(());
+    }
+    socket.multicast_group = Some(source_address);
+    drop(sockets);
+
+    // The device locks are taken after the socket table lock is released, as
+    // the interrupt handler takes them in the other order.
+    for interface in interfaces() {
+        let mut device = interface.device.lock();
+        device.join_multicast(EthernetAddress::from_ipv4_multicast(source_address));
+    }
 
     Ok(())
 }
 
 /// Connect to a remote socket.
+///
+/// Datagrams are sent from the interface the socket is bound to, otherwise
+/// from the interface on the same network as the remote.
 fn connect(socket_id: u32, dest_address: u32, dest_port: u32) -> Result<(), ()> {
-    let mut sockets = SOCKETS.lock();
-    let mut socket = match sockets.get_mut(&(socket_id as usize)) {
+    // Copy out the bound interface rather than holding the socket table lock
+    // while resolving, which takes the device lock, taken before the socket
+    // table lock elsewhere.
+    let bound = match SOCKETS.lock().get(&(socket_id as usize)) {
+        Some(x) => x.interface,
+        None => return Err(()),
+    };
+
+    let dest_protocol_address = Ipv4Addr::from(dest_address as u32);
+    let interface = match bound {
+        Some(x) => interface(x),
+        None => route_interface(dest_protocol_address),
+    };
+    let interface = match interface {
         Some(x) => x,
         None => return Err(()),
     };
 
     // Look up the desination hardware address from the cache or try and resolve it.
-    let dest_protocol_address = Ipv4Addr::from(dest_address as u32);
     let dest_hardware_address = {
         let arp_cache = ARP_CACHE.lock();
         arp_cache.hardware_address(&dest_protocol_address)
@@ -297,13 +1103,14 @@ fn connect(socket_id: u32, dest_address: u32, dest_port: u32) -> Result<(), ()>
             // Address not in the cache. Make the request, release the device lock try and
             // and block until the address is resolved.
             {
-                let mut device = NETWORK_DEVICE.lock();
-                let device: &mut Box<dyn NetworkDevice> = match *device {
-                    Some(ref mut x) => x,
-                    None => return Err(()),
-                };
-                ArpCache::resolve(&dest_protocol_address, device);
+                let mut device = interface.device.lock();
+                let source = interface.address();
+                if ArpCache::resolve(&dest_protocol_address, source, &mut device).is_err() {
+                    return Err(());
+                }
+                let loopback = device.loopback();
                 drop(device);
+                poll_loopback(interface, loopback);
             }
 
             // Wait 1 seconds for a response.
@@ -326,8 +1133,14 @@ fn connect(socket_id: u32, dest_address: u32, dest_port: u32) -> Result<(), ()>
 
     // Populate the Socket with the address of the local adaptor, a new ephermal
     // port and the details of the remote.
+    let mut sockets = SOCKETS.lock();
+    let socket = match sockets.get_mut(&(socket_id as usize)) {
+        Some(x) => x,
+        None => return Err(()),
+    };
     socket.source_port = Some((1024 + socket_id) as u16);
-    socket.source_address = Some(Ipv4Addr::from(0x0A000002 as u32));
+    socket.interface = Some(interface.index);
+    socket.source_address = Some(interface.address());
     socket.dest_port = Some((dest_port as i16).try_into().unwrap());
     socket.dest_hardware_address = Some(dest_hardware_address);
     socket.dest_protocol_address = Some(dest_protocol_address);
@@ -335,75 +1148,269 @@ fn connect(socket_id: u32, dest_address: u32, dest_port: u32) -> Result<(), ()>
     Ok(())
 }
 
+/// How far a datagram sent as IP fragments has got.
+#[derive(Default)]
+struct FragmentProgress {
+    /// The identification of the datagram, once chosen.
+    id: Option<u16>,
+    /// The offset into the IP payload of the next fragment to send.
+    offset: usize,
+}
+
 /// Encapsulate and send data on a socket.
 ///
-/// TODO:
-/// 	- Refactor packet building to one place.
-/// 	- Check socket has been setup with connect(...).
-fn send(socket_id: u32, data: &[u8]) -> Result<u32, ()> {
-    let mut sockets = SOCKETS.lock();
-    let socket = match sockets.get_mut(&(socket_id as usize)) {
-        Some(x) => x,
-        None => return Err(()),
+/// Returns `SocketError::WouldBlock` if the device has no room for the
+/// datagram. A datagram sent as fragments may be part sent by then, and
+/// `progress` records how far, so calling again with the same `progress`
+/// sends the rest under the same identification.
+fn send(socket_id: u32, data: &[u8], progress: &mut FragmentProgress) -> Result<u32, SocketError> {
+    // Copy out the route rather than holding the socket table lock while the
+    // device lock is taken, which the interrupt handler takes in the other
+    // order.
+    let route = {
+        let sockets = SOCKETS.lock();
+        match sockets.get(&(socket_id as usize)) {
+            Some(x) => x.route()?,
+            None => return Err(SocketError::Invalid),
+        }
     };
 
-    // Create a new packet buffer.
-    let mut packet = PacketBuffer::new(BUFFER_SIZE);
+    let interface = interface(route.interface).ok_or(SocketError::Invalid)?;
+    let mut device = interface.device.lock();
 
-    // Build and write the udp packet, sending up to a maximum of 1024 bytes.
-    let data_len: u16 = if data.len() > 1024 {
-        1024
+    // The payload is handed to the device separately from the headers so it
+    // is only copied once, if at all. Datagrams that do not fit in a frame
+    // are split into IP fragments.
+    let data_len = core::cmp::min(data.len(), MAX_DATAGRAM);
+    if data_len > max_payload(&device) {
+        send_fragments(&mut device, &route, &data[..data_len], progress)?;
     } else {
-        data.len() as u16
+        let payload = payload_fragment(&data[..data_len]);
+
+        let mut packet = PacketBuffer::new(BUFFER_SIZE);
+        write_udp_headers(&mut packet, &route, &device, &data[..data_len]);
+
+        if data_len == 0 {
+            device.send(packet)?;
+        } else {
+            device.send_gather(packet, &[payload])?;
+        }
+    }
+    let loopback = device.loopback();
+    drop(device);
+    poll_loopback(interface, loopback);
+    interface.stats.lock().tx_packets += 1;
+
+    Ok(data_len as u32)
+}
+
+/// Send `data` along `route` as a UDP datagram split into IP fragments.
+///
+/// Only the first fragment carries the UDP header, so its checksum is
+/// computed here rather than by the device. Sending starts from the fragment
+/// recorded in `progress`, which is advanced past each fragment sent, so if
+/// the device runs out of room part way through the rest can be sent once
+/// it has some.
+fn send_fragments(
+    device: &mut Box<dyn NetworkDevice>,
+    route: &Route,
+    data: &[u8],
+    progress: &mut FragmentProgress,
+) -> Result<(), TxError> {
+    let mtu = device
+        .parameter(DeviceParameter::Mtu)
+        .unwrap_or(DEFAULT_MTU) as usize;
+    // The data of every fragment but the last is a multiple of 8 bytes.
+    let fragment_len = (mtu - 20) & !7;
+    let id = *progress
+        .id
+        .get_or_insert_with(|| FRAGMENT_ID.fetch_add(1, Ordering::Relaxed));
+
+    let mut udp_header =
+        UdpPacket::new_header(route.source_port, route.dest_port, data.len() as u16);
+    udp_header.set_checksum(route.source_address, route.dest_protocol_address, data);
+
+    // Offsets are into the IP payload, the UDP header followed by the data.
+    let total = data.len() + 8;
+    while progress.offset < total {
+        let offset = progress.offset;
+        let len = core::cmp::min(fragment_len, total - offset);
+        let mut packet = PacketBuffer::new(BUFFER_SIZE);
+        let payload = if offset == 0 {
+            packet.serialize(&udp_header);
+            &data[..len - 8]
+        } else {
+            &data[offset - 8..offset + len - 8]
+        };
+
+        let ip_packet = Ipv4Packet::new(
+            0,
+            0,
+            (len + 20) as u16,
+            id,
+            false,
+            offset + len < total,
+            (offset / 8) as u16,
+            64,
+            Protocol::UDP,
+            route.source_address,
+            route.dest_protocol_address,
+        );
+        packet.serialize(&ip_packet);
+
+        let ethernet_frame = EthernetFrame::new(
+            route.dest_hardware_address,
+            device.hardware_address(),
+            Ethertype::IPV4,
+        );
+        packet.serialize(&ethernet_frame);
+
+        device.send_gather(packet, &[payload_fragment(payload)])?;
+        progress.offset += len;
+    }
+    Ok(())
+}
+
+/// Encapsulate and send a batch of messages on a socket.
+///
+/// Each message is sent as its own datagram, but the datagrams are handed to
+/// the network device as a single batch. Returns the number of messages sent,
+/// which is less than the number given if the device runs out of room.
+/// Messages are truncated to fit in a frame rather than fragmented.
+fn sendmmsg(socket_id: u32, msgs: &[MMsg]) -> Result<u32, SocketError> {
+    let route = {
+        let sockets = SOCKETS.lock();
+        match sockets.get(&(socket_id as usize)) {
+            Some(x) => x.route()?,
+            None => return Err(SocketError::Invalid),
+        }
     };
 
-    let udp_packet = UdpPacket::new(
-        socket.source_port.unwrap(),
-        socket.dest_port.unwrap(),
-        data[..data_len as usize].to_vec(),
+    let interface = interface(route.interface).ok_or(SocketError::Invalid)?;
+    let mut device = interface.device.lock();
+
+    // Messages are copied whole into a packet buffer alongside the headers.
+    let max_len = core::cmp::min(
+        max_payload(&device),
+        BUFFER_SIZE - HEADER_LEN - UDP_IP_HEADER_LEN,
     );
-    packet.serialize(&udp_packet);
 
-    // Build and write the IP packet.
-    let ip_packet = Ipv4Packet::new(
+    let mut sent = 0;
+    for chunk in msgs.chunks(TX_BATCH) {
+        let mut batch = Vec::with_capacity(TX_BATCH);
+        for msg in chunk {
+            if msg.len < 0 || msg.buf.is_null() {
+                return Err(SocketError::Invalid);
+            }
+            let data = unsafe { slice::from_raw_parts(msg.buf, msg.len as usize) };
+            let data = &data[..core::cmp::min(data.len(), max_len)];
+
+            let mut packet = PacketBuffer::new(BUFFER_SIZE);
+            packet.serialize(data);
+            write_udp_headers(&mut packet, &route, &device, data);
+            batch.push(packet);
+        }
+
+        let n = device.send_batch(0, &mut batch.into_iter());
+        interface.stats.lock().tx_packets += n as u32;
+        sent += n;
+        if n < chunk.len() {
+            break;
+        }
+    }
+    let loopback = device.loopback();
+    drop(device);
+    poll_loopback(interface, loopback);
+
+    Ok(sent as u32)
+}
+
+/// The largest amount of data that fits in a single datagram on `device`.
+fn max_payload(device: &Box<dyn NetworkDevice>) -> usize {
+    let mtu = device
+        .parameter(DeviceParameter::Mtu)
+        .unwrap_or(DEFAULT_MTU);
+    mtu as usize - UDP_IP_HEADER_LEN
+}
+
+/// Write the UDP, IP and ethernet headers for `data` sent along `route`.
+///
+/// Checksums are left for the device to insert if it can, otherwise they are
+/// computed here.
+fn write_udp_headers(
+    packet: &mut PacketBuffer,
+    route: &Route,
+    device: &Box<dyn NetworkDevice>,
+    data: &[u8],
+) {
+    let offload = device.offload();
+    let ip_start = HEADER_LEN;
+    let udp_start = ip_start + 20;
+
+    let mut udp_header =
+        UdpPacket::new_header(route.source_port, route.dest_port, data.len() as u16);
+    if offload.tx_udp_checksum {
+        udp_header.set_pseudo_header_checksum(route.source_address, route.dest_protocol_address);
+    } else {
+        udp_header.set_checksum(route.source_address, route.dest_protocol_address, data);
+    }
+    packet.serialize(&udp_header);
+
+    let mut ip_packet = Ipv4Packet::new(
         0,
         0,
-        (packet.len() + 20) as u16,
+        (data.len() + UDP_IP_HEADER_LEN) as u16,
         0,
         true,
         false,
         0,
         64,
         Protocol::UDP,
-        socket.source_address.unwrap(),
-        socket.dest_protocol_address.unwrap(),
+        route.source_address,
+        route.dest_protocol_address,
     );
+    if offload.tx_ip_checksum {
+        ip_packet.offload_checksum();
+    }
     packet.serialize(&ip_packet);
 
-    // Write the ethernet frame header and send the frame.
-    let mut device = NETWORK_DEVICE.lock();
-    let device: &mut Box<dyn NetworkDevice> = match *device {
-        Some(ref mut x) => x,
-        None => return Err(()),
-    };
-
     let ethernet_frame = EthernetFrame::new(
-        socket.dest_hardware_address.unwrap(),
+        route.dest_hardware_address,
         device.hardware_address(),
         Ethertype::IPV4,
     );
     packet.serialize(&ethernet_frame);
 
-    device.send(packet);
+    if offload.tx_ip_checksum || offload.tx_udp_checksum {
+        packet.set_tx_checksum(TxChecksum {
+            ip_header: offload.tx_ip_checksum.then_some(ip_start),
+            transport: offload
+                .tx_udp_checksum
+                .then_some((udp_start, udp_start + 6)),
+        });
+    }
+}
 
-    // Encapsulate the data in a UDP packet.
-    Ok(data_len as u32)
+/// Describe a payload to the network device.
+///
+/// Page aligned user buffers that fit in a page are handed to the device by
+/// physical address and are never copied. Anything else is copied once, by
+/// the device, into its transmit buffers.
+fn payload_fragment(data: &[u8]) -> TxFragment {
+    if data.as_ptr() as usize % PAGE_SIZE == 0 && data.len() <= PAGE_SIZE {
+        let addr = unsafe { uva2kva(data.as_ptr()) };
+        if !addr.is_null() {
+            return TxFragment::Direct(PhysicalAddress::from_virtual(addr as u64), data.len());
+        }
+    }
+    TxFragment::Copy(data)
 }
 
-/// Read available data from a socket.
+/// Read the next datagram from a socket.
 ///
 /// This call is non-blocking, returning immediately if no data is
-/// available.
+/// available. Any part of the datagram that does not fit in `data` is
+/// discarded.
 fn recv(socket_id: u32, data: &mut [u8], len: u32) -> Result<u32, ()> {
     let mut sockets = SOCKETS.lock();
     let socket = match sockets.get_mut(&(socket_id as usize)) {
@@ -412,74 +1419,196 @@ fn recv(socket_id: u32, data: &mut [u8], len: u32) -> Result<u32, ()> {
     };
 
     // Does the socket have any data available?
-    if socket.buffer.len() == 0 {
-        return Ok(0);
-    }
-
-    // Copy the most data we can from the socket buffer to userspace buffer.
-    let len = len as usize;
-    let copy_size = if socket.buffer.len() > len {
-        len
-    } else {
-        socket.buffer.len()
+    let datagram = match socket.buffer.pop_front() {
+        Some(x) => x,
+        None => return Ok(0),
     };
-    data[..copy_size].copy_from_slice(&socket.buffer[..copy_size]);
 
-    // Shrink the socket buffer to remove the copied data.
-    let new_size = socket.buffer.len() - copy_size;
-    socket.buffer.truncate(new_size);
+    // Copy the most data we can from the datagram to the userspace buffer.
+    let copy_size = core::cmp::min(datagram.len, len as usize);
+    let copied = datagram.buf.copy_remaining(&mut data[..copy_size]);
 
-    Ok(copy_size.try_into().unwrap())
+    Ok(copied as u32)
 }
 
 /// Clean up a socket and its resouces.
 fn shutdown_socket(socket_id: u32) -> Result<(), ()> {
     let mut sockets = SOCKETS.lock();
-    match sockets.remove(&(socket_id as usize)) {
-        Some(_) => Ok(()),
-        None => Err(()),
+    let socket = match sockets.remove(&(socket_id as usize)) {
+        Some(x) => x,
+        None => return Err(()),
+    };
+    drop(sockets);
+
+    if let Some(group) = socket.multicast_group {
+        for interface in interfaces() {
+            let mut device = interface.device.lock();
+            device.leave_multicast(EthernetAddress::from_ipv4_multicast(group));
+        }
     }
+    Ok(())
 }
 
-/// Main entrypoint for network device interrupts.
-fn handle_interrupt() {
-    let mut device = NETWORK_DEVICE.lock();
-    let mut device: &mut Box<dyn NetworkDevice> = match *device {
-        Some(ref mut x) => x,
-        None => panic!("no network device\n\x00"),
+/// Main entrypoint for network device interrupts, for the device of
+/// `interface`.
+///
+/// Received frames are not handled here. Receive interrupts are masked and
+/// the network thread is woken to drain the device, so a flood of frames
+/// cannot keep a CPU in the interrupt handler.
+fn handle_interrupt(interface: &Interface, vector: Option<usize>) {
+    let status = {
+        let mut device = interface.device.lock();
+
+        // Clear device interrupt register.
+        let status = device.clear_interrupts(vector);
+        for queue in rx_queues(&status) {
+            device.disable_rx_interrupts(queue);
+            interface.poll_pending[queue].store(true, Ordering::Release);
+        }
+        status
     };
+    if !status.raised() {
+        return;
+    }
 
-    // Clear device interrupt register.
-    device.clear_interrupts();
+    let mut stats = interface.stats.lock();
+    stats.interrupts += 1;
+    stats.rx_overruns += status.rx_overrun as u32;
+    stats.rx_missed += status.rx_missed;
+    drop(stats);
 
-    // Handle all avaliable packets.
+    for queue in rx_queues(&status) {
+        NETD_WAIT[queue].wake();
+    }
+
+    // Wake any senders waiting for transmit descriptors.
+    if status.tx_done {
+        TX_WAKEUPS.fetch_add(1, Ordering::Release);
+        TX_WAIT.wake();
+    }
+}
+
+/// Return the receive queues reported in `status`.
+fn rx_queues(status: &InterruptStatus) -> impl Iterator<Item = usize> {
+    let mask = status.rx_queues;
+    (0..MAX_QUEUES).filter(move |x| mask & (1 << x) != 0)
+}
+
+/// Handle up to `budget` frames received on `queue` of `interface` if its
+/// poller has been scheduled.
+///
+/// Frames are taken from the device in batches, and handled with the device
+/// lock released so the pollers of other queues are not held up by protocol
+/// processing. Receive interrupts are unmasked again once the queue has no
+/// frames left, otherwise the poller stays scheduled for another pass. Any
+/// replies generated are sent in batches on the paired transmit queue, and
+/// replies the device has no room for are dropped.
+fn poll(interface: &Interface, queue: usize, budget: usize) {
+    if !interface.poll_pending[queue].swap(false, Ordering::Acquire) {
+        return;
+    }
+
+    let mut stats = NetStats::new();
+    let mut replies = Vec::with_capacity(TX_BATCH);
+    let mut drained = false;
     loop {
-        match device.recv() {
-            Some(b) => handle_packet(b, &mut device),
-            None => break,
+        let mut frames = Vec::with_capacity(TX_BATCH);
+        let addresses = {
+            let mut device = interface.device.lock();
+            send_replies(&mut device, queue, &mut replies, &mut stats);
+
+            if drained || stats.rx_packets as usize >= budget {
+                if !drained || device.enable_rx_interrupts(queue) {
+                    interface.poll_pending[queue].store(true, Ordering::Release);
+                }
+                break;
+            }
+            while frames.len() < TX_BATCH && (stats.rx_packets as usize) < budget {
+                match device.recv(queue) {
+                    Some(b) => {
+                        stats.rx_packets += 1;
+                        frames.push(b);
+                    }
+                    None => {
+                        drained = true;
+                        break;
+                    }
+                }
+            }
+            InterfaceAddresses::new(interface, &device)
+        };
+
+        for frame in frames {
+            if let Some(reply) = handle_packet(frame, &addresses) {
+                replies.push(reply);
+            }
         }
     }
+
+    interface.stats.lock().add(&stats);
+}
+
+/// Send a batch of replies on transmit queue `queue`, dropping any the
+/// device has no room for.
+fn send_replies(
+    device: &mut Box<dyn NetworkDevice>,
+    queue: usize,
+    replies: &mut Vec<PacketBuffer>,
+    stats: &mut NetStats,
+) {
+    if replies.is_empty() {
+        return;
+    }
+    let queued = replies.len() as u32;
+    let sent = device.send_batch(queue, &mut replies.drain(..)) as u32;
+    stats.tx_packets += sent;
+    stats.tx_dropped += queued - sent;
 }
 
 /// Main entrypoint into the kernel network stack.
 ///
-/// Handles a single, ethernet frame encapsulated packet. Potentially writes
-/// packets back to the network device.
-fn handle_packet(mut buffer: PacketBuffer, device: &mut Box<dyn NetworkDevice>) {
+/// Handles a single, ethernet frame encapsulated packet. Returns any reply
+/// that should be written back to the network device.
+fn handle_packet(mut buffer: PacketBuffer, addresses: &InterfaceAddresses) -> Option<PacketBuffer> {
     let ethernet_frame = match buffer.parse::<EthernetFrame>() {
         Ok(x) => x,
-        Err(_) => return,
+        Err(_) => return None,
     };
 
     match ethernet_frame.ethertype {
         Ethertype::IPV4 => {
+            // Drop packets with a bad header checksum, checking it here if
+            // the device did not.
+            let valid = match buffer.rx_checksum().ip {
+                ChecksumStatus::Good => true,
+                ChecksumStatus::Bad => false,
+                ChecksumStatus::Unchecked => match buffer.segments().next() {
+                    Some(x) => Ipv4Packet::checksum_valid(x),
+                    None => false,
+                },
+            };
+            if !valid {
+                return None;
+            }
+
             let ip_packet = match buffer.parse::<Ipv4Packet>() {
                 Ok(x) => x,
-                Err(_) => return,
+                Err(_) => return None,
             };
 
+            // Drop the padding of short frames, then hold fragments until
+            // the whole datagram has arrived. Only UDP datagrams are
+            // reassembled.
+            buffer.truncate(ip_packet.data_len());
+            if ip_packet.is_fragment() {
+                if !matches!(ip_packet.protocol(), Protocol::UDP) {
+                    return None;
+                }
+                buffer = reassemble(buffer, &ip_packet)?;
+            }
+
             match ip_packet.protocol() {
-                Protocol::ICMP => match handle_icmp(&mut buffer) {
+                Protocol::ICMP => match handle_icmp(&buffer) {
                     Some(mut x) => {
                         let ip_packet = Ipv4Packet::new(
                             0,
@@ -491,52 +1620,153 @@ fn handle_packet(mut buffer: PacketBuffer, device: &mut Box<dyn NetworkDevice>)
                             0,
                             64,
                             Protocol::ICMP,
-                            device.protocol_address(),
+                            addresses.protocol,
                             ip_packet.source(),
                         );
                         x.serialize(&ip_packet);
 
                         let ethernet_frame = EthernetFrame::new(
                             ethernet_frame.source,
-                            device.hardware_address(),
+                            addresses.hardware,
                             Ethertype::IPV4,
                         );
                         x.serialize(&ethernet_frame);
-                        device.send(x);
+                        Some(x)
                     }
-                    None => (),
+                    None => None,
                 },
                 Protocol::UDP => {
-                    handle_udp(&mut buffer);
+                    handle_udp(buffer, &ip_packet, addresses.index);
+                    None
                 }
-                Protocol::TCP => (),
-                Protocol::UNKNOWN => (),
+                Protocol::TCP => None,
+                Protocol::UNKNOWN => None,
             }
         }
-        Ethertype::ARP => match handle_arp(&mut buffer, &device) {
+        Ethertype::ARP => match handle_arp(&buffer, addresses) {
             Some(mut x) => {
                 // Encapsulate the ARP response.
-                let ethernet_frame = EthernetFrame::new(
-                    ethernet_frame.source,
-                    device.hardware_address(),
-                    Ethertype::ARP,
-                );
+                let ethernet_frame =
+                    EthernetFrame::new(ethernet_frame.source, addresses.hardware, Ethertype::ARP);
                 x.serialize(&ethernet_frame);
-                device.send(x);
+                Some(x)
             }
-            None => (),
+            None => None,
         },
-        Ethertype::WAKE_ON_LAN => (),
-        Ethertype::RARP => (),
-        Ethertype::SLPP => (),
-        Ethertype::IPV6 => (),
-        Ethertype::UNKNOWN => (),
+        Ethertype::WAKE_ON_LAN => None,
+        Ethertype::RARP => None,
+        Ethertype::SLPP => None,
+        Ethertype::IPV6 => None,
+        Ethertype::UNKNOWN => None,
     }
 }
 
+/// A datagram being reassembled from IP fragments.
+struct Reassembly {
+    /// The source, destination and identification shared by the fragments.
+    key: (Ipv4Addr, Ipv4Addr, u16),
+    /// The fragments received so far, with their offsets into the datagram,
+    /// in offset order.
+    fragments: Vec<(usize, PacketBuffer)>,
+    /// The length of the datagram, once its last fragment has arrived.
+    len: Option<usize>,
+    /// When the first fragment arrived.
+    started: u32,
+}
+
+/// Add a received fragment, parsed up to its data, to the datagram it
+/// belongs to. Returns the whole datagram once every fragment has arrived.
+///
+/// The datagram is the fragments chained in order, without copying them, so
+/// it can be queued on a socket like any other received packet. The device
+/// cannot have checked the transport checksum of a fragment, so it is
+/// checked over the whole datagram.
+fn reassemble(buffer: PacketBuffer, ip_packet: &Ipv4Packet) -> Option<PacketBuffer> {
+    let key = (
+        ip_packet.source(),
+        ip_packet.destination(),
+        ip_packet.identification(),
+    );
+    let offset = ip_packet.fragment_offset();
+    let len = buffer.remaining();
+    let now = unsafe { core::ptr::read_volatile(&ticks) };
+
+    let mut table = REASSEMBLY.lock();
+    table.retain(|x| now.wrapping_sub(x.started) < REASSEMBLY_TIMEOUT);
+    let index = match table.iter().position(|x| x.key == key) {
+        Some(x) => x,
+        None => {
+            if table.len() == REASSEMBLY_SLOTS {
+                table.remove(0);
+            }
+            table.push(Reassembly {
+                key: key,
+                fragments: Vec::new(),
+                len: None,
+                started: now,
+            });
+            table.len() - 1
+        }
+    };
+
+    // Duplicate fragments are dropped. Overlapping fragments leave a gap or
+    // overlap that never completes, so the datagram times out.
+    let entry = &mut table[index];
+    match entry.fragments.binary_search_by_key(&offset, |x| x.0) {
+        Ok(_) => return None,
+        Err(_) if entry.fragments.len() == REASSEMBLY_FRAGMENTS => return None,
+        Err(i) => entry.fragments.insert(i, (offset, buffer)),
+    }
+    if !ip_packet.more_fragments() {
+        entry.len = Some(offset + len);
+    }
+
+    // Has every byte of the datagram arrived?
+    let mut end = 0;
+    for (offset, buf) in entry.fragments.iter() {
+        if *offset != end {
+            return None;
+        }
+        end += buf.remaining();
+    }
+    if entry.len != Some(end) {
+        return None;
+    }
+
+    let entry = table.remove(index);
+    drop(table);
+    let mut fragments = entry.fragments.into_iter().map(|x| x.1);
+    let mut datagram = fragments.next()?;
+    for x in fragments {
+        datagram.append(x);
+    }
+    datagram.set_rx_checksum(RxChecksum::UNCHECKED);
+    Some(datagram)
+}
+
 /// Handle an ICMP packet.
-pub fn handle_icmp(buffer: &mut PacketBuffer) -> Option<PacketBuffer> {
-    let icmp_packet = match buffer.parse::<IcmpPacket>() {
+///
+/// The data of an echo request is copied once, straight from the received
+/// packet into the reply, which is sized to hold it along with the IP and
+/// ethernet headers. Requests received in a frame that spans several buffers
+/// are gathered into one copy first.
+pub fn handle_icmp(buffer: &PacketBuffer) -> Option<PacketBuffer> {
+    let gathered;
+    let mut segments = buffer.segments();
+    let first = segments.next()?;
+    let data = match segments.next() {
+        None => first,
+        Some(_) => {
+            gathered = {
+                let mut x = vec![0u8; buffer.remaining()];
+                buffer.copy_remaining(&mut x);
+                x
+            };
+            &gathered[..]
+        }
+    };
+
+    let icmp_packet = match IcmpPacket::from_slice(data) {
         Ok(x) => x,
         Err(_) => return None,
     };
@@ -545,7 +1775,7 @@ pub fn handle_icmp(buffer: &mut PacketBuffer) -> Option<PacketBuffer> {
         IcmpPacket::EchoMessage(x) => {
             if x.r#type == Type::EchoRequest {
                 let reply = IcmpPacket::EchoMessage(IcmpEchoMessage::from_request(x));
-                let mut packet = PacketBuffer::new(BUFFER_SIZE);
+                let mut packet = PacketBuffer::new(reply.size() + 20 + HEADER_LEN);
                 packet.serialize(&reply);
                 return Some(packet);
             }
@@ -558,10 +1788,7 @@ pub fn handle_icmp(buffer: &mut PacketBuffer) -> Option<PacketBuffer> {
 ///
 /// Handle an ARP packet, optionally returning any response that needs to be
 /// serialized to the network.
-pub fn handle_arp(
-    buffer: &mut PacketBuffer,
-    device: &Box<dyn NetworkDevice>,
-) -> Option<PacketBuffer> {
+fn handle_arp(buffer: &PacketBuffer, addresses: &InterfaceAddresses) -> Option<PacketBuffer> {
     let arp_packet = match buffer.parse::<ArpPacket>() {
         Ok(x) => x,
         Err(_) => return None,
@@ -571,10 +1798,9 @@ pub fn handle_arp(
     match arp_packet.oper {
         arp::Operation::Request => {
             // Is this a request for us?
-            if arp_packet.tpa == device.protocol_address() {
+            if arp_packet.tpa == addresses.protocol {
                 // Build the ARP reply.
-                let hardware_address = device.hardware_address();
-                let reply = ArpPacket::from_request(&arp_packet, hardware_address);
+                let reply = ArpPacket::from_request(&arp_packet, addresses.hardware);
                 let mut packet = PacketBuffer::new(BUFFER_SIZE);
                 packet.serialize(&reply);
                 return Some(packet);
@@ -591,39 +1817,66 @@ pub fn handle_arp(
 
 /// Handle a UDP packet.
 ///
-/// If this packet is destined for a socket and that socket has space in its
-/// buffer, copy the packet data into the socket buffer.
-pub fn handle_udp(buffer: &mut PacketBuffer) {
-    let packet = match buffer.parse::<UdpPacket>() {
+/// If this packet, received on interface `interface`, is destined for a
+/// socket and that socket has space in its buffer, queue the packet on the
+/// socket. The header is read in place and the data is not copied until it
+/// is read.
+///
+/// Unicast datagrams go to the first socket bound to their port. Multicast
+/// and broadcast datagrams go to every such socket, which share the buffer.
+pub fn handle_udp(mut buffer: PacketBuffer, ip_packet: &Ipv4Packet, interface: usize) {
+    let packet = match buffer.parse::<UdpView>() {
         Ok(x) => x,
         Err(_) => return,
     };
 
-    // Is this packet destined for an active socket?
-    let mut sockets = SOCKETS.lock();
-    let socket_id = {
-        let mut socket_id = None;
-        for (k, v) in sockets.iter() {
-            if Some(packet.dest_port()) == v.source_port {
-                socket_id = Some(k);
-                break;
-            }
-        }
-
-        match socket_id {
-            Some(id) => *id,
-            None => return,
-        }
-    };
-
-    let socket = match sockets.get_mut(&(socket_id as usize)) {
-        Some(x) => x,
-        None => panic!("socket not found\n\x00"),
+    // Drop packets with a bad checksum, checking it here if the device did
+    // not.
+    let valid = match buffer.rx_checksum().transport {
+        ChecksumStatus::Good => true,
+        ChecksumStatus::Bad => false,
+        ChecksumStatus::Unchecked => packet.checksum_valid(
+            ip_packet.source(),
+            ip_packet.destination(),
+            buffer.segments(),
+        ),
     };
+    if !valid {
+        return;
+    }
+    let dest_port = packet.dest_port();
+    let len = packet.data_len();
 
-    // Do we have space in the socket buffer for the new data?
-    if socket.buffer.len() + packet.data().len() >= BUFFER_SIZE {
+    // Is the whole datagram here?
+    if len > buffer.remaining() {
         return;
     }
-    socket.buffer.extend_from_slice(&packet.data());
+    let destination = ip_packet.destination();
+    let group = destination.is_multicast() || destination == Ipv4Addr::new(255, 255, 255, 255);
+
+    // Is this packet destined for an active socket? Each socket but the last
+    // gets a shared copy of the buffer, the last gets the buffer itself.
+    let mut sockets = SOCKETS.lock();
+    let mut matching = sockets
+        .values_mut()
+        .filter(|x| {
+            Some(dest_port) == x.source_port && x.interface.map_or(true, |x| x == interface)
+        })
+        .take(if group { usize::MAX } else { 1 })
+        .peekable();
+    while let Some(socket) = matching.next() {
+        // Do we have space for it?
+        if socket.buffer.len() >= RECV_QUEUE_LEN {
+            continue;
+        }
+        if matching.peek().is_some() {
+            socket.buffer.push_back(Datagram {
+                buf: buffer.share(),
+                len,
+            });
+        } else {
+            socket.buffer.push_back(Datagram { buf: buffer, len });
+            return;
+        }
+    }
 }
@@ -1,87 +1,521 @@
+use alloc::boxed::Box;
+use alloc::sync::Arc;
 use alloc::vec;
 use alloc::vec::Vec;
+use core::cell::Cell;
+use core::mem;
+use core::slice;
+use core::sync::atomic::{AtomicU32, Ordering};
 
-pub static BUFFER_SIZE: usize = 2048;
+use crate::kernel::{cpuid, kalloc, popcli, pushcli, NCPU};
+use crate::mm::{FreeList, PAGE_SIZE};
+use crate::spinlock::Spinlock;
+
+pub const BUFFER_SIZE: usize = 2048;
+
+/// The number of packet buffers allocated for the pool on start-up.
+const POOL_BUFFERS: usize = 256;
+
+/// The most free buffers a CPU caches. Buffers move between a CPU cache and
+/// the shared list CPU_CACHE_BATCH at a time.
+const CPU_CACHE_MAX: usize = 32;
+const CPU_CACHE_BATCH: usize = CPU_CACHE_MAX / 2;
+
+/// Free packet buffers shared by every CPU, which refill and drain the CPU
+/// caches.
+///
+/// The pool is carved out of kalloc() pages on start-up, and grows by a page
+/// whenever it runs dry. Buffers are never returned to kalloc().
+static POOL: Spinlock<FreeList> = Spinlock::new(FreeList::new());
+
+/// Free packet buffers cached by each CPU, so most buffers are allocated and
+/// freed without touching the shared list, and are reused while still warm in
+/// the cache of the CPU that freed them. The lock of a cache is only
+/// contended if a process migrates between choosing the cache and taking its
+/// lock.
+static CPU_CACHES: [Spinlock<FreeList>; NCPU] = [EMPTY_CACHE; NCPU];
+const EMPTY_CACHE: Spinlock<FreeList> = Spinlock::new(FreeList::new());
+
+/// Pool counters, see struct netstat in net.h.
+static POOL_SIZE: AtomicU32 = AtomicU32::new(0);
+static POOL_IN_USE: AtomicU32 = AtomicU32::new(0);
+static POOL_MISSES: AtomicU32 = AtomicU32::new(0);
+
+/// The memory backing a PacketBuffer.
+enum Storage {
+    /// A heap allocation owned by the buffer.
+    Owned(Vec<u8>),
+    /// Memory loaned to the buffer, a device receive buffer or a buffer from
+    /// the pool. The memory is handed back through `release` when the buffer
+    /// is dropped.
+    Loaned {
+        ptr: *mut u8,
+        len: usize,
+        release: fn(*mut u8),
+    },
+    /// Storage shared by several buffers, released when the last of them is
+    /// dropped. Shared storage is read only.
+    Shared(Arc<Storage>),
+}
+
+impl Storage {
+    /// The full extent of the storage.
+    fn bytes(&self) -> &[u8] {
+        match self {
+            Storage::Owned(x) => &x[..],
+            Storage::Loaned { ptr, len, .. } => unsafe { slice::from_raw_parts(*ptr, *len) },
+            Storage::Shared(x) => x.bytes(),
+        }
+    }
+
+    /// The full extent of the storage.
+    fn bytes_mut(&mut self) -> &mut [u8] {
+        match self {
+            Storage::Owned(x) => &mut x[..],
+            Storage::Loaned { ptr, len, .. } => unsafe { slice::from_raw_parts_mut(*ptr, *len) },
+            Storage::Shared(x) => match Arc::get_mut(x) {
+                Some(x) => x.bytes_mut(),
+                None => panic!("write to shared packet buffer\n\x00"),
+            },
+        }
+    }
+}
+
+impl Drop for Storage {
+    fn drop(&mut self) {
+        if let Storage::Loaned { ptr, release, .. } = *self {
+            release(ptr);
+        }
+    }
+}
+
+/// Checksums for the device to insert when a packet is sent.
+///
+/// Offsets are from the start of the frame.
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub struct TxChecksum {
+    /// The offset of an IPv4 header whose header checksum is inserted.
+    pub ip_header: Option<usize>,
+    /// The offset the transport checksum is computed from, to the end of the
+    /// frame, and the offset of the field it is inserted into. The field must
+    /// already hold the sum of the pseudo-header.
+    pub transport: Option<(usize, usize)>,
+}
+
+/// The result of a checksum check made by the device on receive.
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum ChecksumStatus {
+    /// The device did not check the checksum.
+    Unchecked,
+    /// The device found the checksum to be correct.
+    Good,
+    /// The device found the checksum to be wrong.
+    Bad,
+}
+
+/// Checksums checked by the device on receive.
+#[derive(Debug, Copy, Clone)]
+pub struct RxChecksum {
+    /// The IPv4 header checksum.
+    pub ip: ChecksumStatus,
+    /// The TCP or UDP checksum.
+    pub transport: ChecksumStatus,
+}
+
+impl RxChecksum {
+    /// Neither checksum was checked.
+    pub const UNCHECKED: RxChecksum = RxChecksum {
+        ip: ChecksumStatus::Unchecked,
+        transport: ChecksumStatus::Unchecked,
+    };
+}
 
 /// Represents raw packet data.
 ///
 /// TODO: Stack allocated buffer?
 pub struct PacketBuffer {
     /// The raw packet data.
-    buf: Vec<u8>,
+    buf: Storage,
     /// The size of the raw packet.
     size: usize,
-    /// The number of bytes we have parsed so far into the buffer.
-    offset: usize,
+    /// The number of bytes we have parsed so far into the buffer. Parsing
+    /// only borrows the buffer, so parsed views can borrow its bytes.
+    offset: Cell<usize>,
     /// Has the buffer been written to?
     written: bool,
+    /// The rest of the packet, for received packets that span more than one
+    /// buffer.
+    next: Option<Box<PacketBuffer>>,
+    /// Checksums the device is asked to insert on transmit.
+    tx_checksum: Option<TxChecksum>,
+    /// Checksums the device checked on receive.
+    rx_checksum: RxChecksum,
 }
 
 impl PacketBuffer {
     /// Create a new buffer with the specified size.
+    ///
+    /// Buffers of up to BUFFER_SIZE bytes are taken from the pool and are not
+    /// zeroed. Packets are serialized back to front, so only bytes that have
+    /// been written are ever read, and the whole buffer is headroom for the
+    /// headers prepended to a payload.
     pub fn new(size: usize) -> PacketBuffer {
+        let buf = if size <= BUFFER_SIZE {
+            Storage::Loaned {
+                ptr: pool_alloc(),
+                len: size,
+                release: pool_release,
+            }
+        } else {
+            Storage::Owned(vec![0u8; size])
+        };
         PacketBuffer {
-            buf: vec![0u8; size],
+            buf: buf,
             size: size,
-            offset: 0,
+            offset: Cell::new(0),
             written: false,
+            next: None,
+            tx_checksum: None,
+            rx_checksum: RxChecksum::UNCHECKED,
         }
     }
 
     /// Create a new buffer from the data provided.
     pub fn new_from_bytes(data: *const u8, size: usize) -> PacketBuffer {
-        let mut packet_buffer = PacketBuffer {
-            buf: vec![0u8; size],
+        let mut buf = vec![0u8; size];
+        unsafe {
+            core::ptr::copy(data, buf.as_mut_ptr(), size);
+        }
+        PacketBuffer {
+            buf: Storage::Owned(buf),
             size: size,
-            offset: 0,
+            offset: Cell::new(0),
             written: false,
-        };
-        unsafe {
-            core::ptr::copy(data, packet_buffer.buf.as_mut_ptr(), size);
+            next: None,
+            tx_checksum: None,
+            rx_checksum: RxChecksum::UNCHECKED,
+        }
+    }
+
+    /// Create a new buffer holding `data`, without copying it.
+    pub fn from_vec(data: Vec<u8>) -> PacketBuffer {
+        PacketBuffer {
+            size: data.len(),
+            buf: Storage::Owned(data),
+            offset: Cell::new(0),
+            written: false,
+            next: None,
+            tx_checksum: None,
+            rx_checksum: RxChecksum::UNCHECKED,
+        }
+    }
+
+    /// Create a new buffer over `size` bytes of loaned memory at `data`.
+    ///
+    /// No copy is made. The buffer takes ownership of the memory until it is
+    /// dropped, at which point `release` is called with `data` so the owner
+    /// can reuse it.
+    pub unsafe fn new_loaned(data: *mut u8, size: usize, release: fn(*mut u8)) -> PacketBuffer {
+        PacketBuffer {
+            buf: Storage::Loaned {
+                ptr: data,
+                len: size,
+                release: release,
+            },
+            size: size,
+            offset: Cell::new(0),
+            written: false,
+            next: None,
+            tx_checksum: None,
+            rx_checksum: RxChecksum::UNCHECKED,
         }
-        packet_buffer
     }
 
     /// Parse a new packet from the buffer.
-    /// TODO: Zero-copy?
-    pub fn parse<T: FromBuffer>(&mut self) -> Result<T, ()> {
-        let value = match T::from_buffer(&self.buf[self.offset..]) {
+    ///
+    /// Nothing is copied for packets parsed into views that borrow the bytes
+    /// of the buffer, and the buffer cannot be written or moved while they
+    /// are in use.
+    pub fn parse<'a, T: FromBuffer<'a>>(&'a self) -> Result<T, ()> {
+        let offset = self.offset.get();
+        let value = match T::from_buffer(&self.bytes()[offset..self.size]) {
             Ok(x) => x,
             Err(_) => return Err(()),
         };
-        self.offset += value.size();
+        self.offset.set(offset + value.size());
         Ok(value)
     }
 
     /// Serialize a new packet to the buffer.
-    /// TODO: Zero-copy?
-    pub fn serialize<T: ToBuffer>(&mut self, value: &T) {
-        self.offset += value.size();
+    ///
+    /// Packets are written back to front, each header in front of the last,
+    /// so prepending a header copies only the header.
+    pub fn serialize<T: ToBuffer + ?Sized>(&mut self, value: &T) {
+        let offset = self.offset.get() + value.size();
+        self.offset.set(offset);
         self.written = true;
-        let start = self.buf.len() - self.offset;
+        let buf = self.bytes_mut();
+        let start = buf.len() - offset;
         let end = start + value.size();
-        value.to_buffer(&mut self.buf[start..end]);
+        value.to_buffer(&mut buf[start..end]);
+    }
+
+    /// Append `segment` to the end of the buffer chain.
+    ///
+    /// Used to assemble a received packet that the device split over several
+    /// buffers. Headers are only parsed from the first buffer in the chain.
+    pub fn append(&mut self, segment: PacketBuffer) {
+        match self.next {
+            Some(ref mut x) => x.append(segment),
+            None => self.next = Some(Box::new(segment)),
+        }
+    }
+
+    /// Return the number of received bytes not yet parsed, across the whole
+    /// buffer chain.
+    pub fn remaining(&self) -> usize {
+        self.segments().map(|x| x.len()).sum()
+    }
+
+    /// Keep only the first `len` received bytes not yet parsed, dropping the
+    /// rest, such as the padding of a short frame. Buffers of the chain past
+    /// the last byte kept are released.
+    pub fn truncate(&mut self, len: usize) {
+        let mut len = len;
+        let mut segment = self;
+        loop {
+            let start = segment.offset.get();
+            if len <= segment.size - start {
+                segment.size = start + len;
+                segment.next = None;
+                return;
+            }
+            len -= segment.size - start;
+            segment = match segment.next {
+                Some(ref mut x) => x,
+                None => return,
+            };
+        }
+    }
+
+    /// Return a buffer sharing the storage of this one, and of the rest of
+    /// its chain, without copying it.
+    ///
+    /// Both buffers are read only from then on. Each has its own parse
+    /// offset, so a received packet can be queued for several readers.
+    pub fn share(&mut self) -> PacketBuffer {
+        if !matches!(self.buf, Storage::Shared(_)) {
+            let buf = mem::replace(&mut self.buf, Storage::Owned(Vec::new()));
+            self.buf = Storage::Shared(Arc::new(buf));
+        }
+        let buf = match self.buf {
+            Storage::Shared(ref x) => Storage::Shared(x.clone()),
+            _ => panic!("share packet buffer\n\x00"),
+        };
+        PacketBuffer {
+            buf: buf,
+            size: self.size,
+            offset: Cell::new(self.offset.get()),
+            written: self.written,
+            next: self.next.as_mut().map(|x| Box::new(x.share())),
+            tx_checksum: self.tx_checksum,
+            rx_checksum: self.rx_checksum,
+        }
+    }
+
+    /// Copy received bytes not yet parsed into `out`, following the buffer
+    /// chain. Returns the number of bytes copied.
+    pub fn copy_remaining(&self, out: &mut [u8]) -> usize {
+        let mut copied = 0;
+        for data in self.segments() {
+            if copied == out.len() {
+                break;
+            }
+            let n = core::cmp::min(data.len(), out.len() - copied);
+            out[copied..copied + n].copy_from_slice(&data[..n]);
+            copied += n;
+        }
+        copied
+    }
+
+    /// Iterate over the received bytes not yet parsed in each buffer of the
+    /// chain.
+    ///
+    /// Each buffer has its own parse offset, so a buffer appended to a chain
+    /// may have had headers parsed from it, as IP fragments do.
+    pub fn segments(&self) -> Segments<'_> {
+        Segments {
+            segment: Some(self),
+        }
+    }
+
+    /// Ask the device to insert checksums when the buffer is sent. Only valid
+    /// if the device offers the offloads used.
+    pub fn set_tx_checksum(&mut self, checksum: TxChecksum) {
+        self.tx_checksum = Some(checksum);
+    }
+
+    /// Return the checksums the device is asked to insert, if any.
+    pub fn tx_checksum(&self) -> Option<TxChecksum> {
+        self.tx_checksum
+    }
+
+    /// Record the checksums the device checked on receive.
+    pub fn set_rx_checksum(&mut self, checksum: RxChecksum) {
+        self.rx_checksum = checksum;
+    }
+
+    /// Return the checksums the device checked on receive.
+    pub fn rx_checksum(&self) -> RxChecksum {
+        self.rx_checksum
     }
 
     /// Return the size of the buffer.
     pub fn len(&self) -> usize {
-        self.offset
+        self.offset.get()
+    }
+
+    /// Return the serialized contents of the buffer.
+    pub fn as_slice(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.as_ptr(), self.len()) }
     }
 
     /// Return a pointer to the underlying buffer.
     pub fn as_ptr(&self) -> *const u8 {
+        let buf = self.bytes();
+        let offset = self.offset.get();
         if self.written {
-            self.buf[self.buf.len() - self.offset..].as_ptr()
+            buf[buf.len() - offset..].as_ptr()
         } else {
-            self.buf[..self.offset].as_ptr()
+            buf[..offset].as_ptr()
+        }
+    }
+
+    /// The full extent of the underlying storage.
+    fn bytes(&self) -> &[u8] {
+        self.buf.bytes()
+    }
+
+    /// The full extent of the underlying storage.
+    fn bytes_mut(&mut self) -> &mut [u8] {
+        self.buf.bytes_mut()
+    }
+}
+
+/// Allocate the packet buffer pool. Called on start-up.
+pub fn init_pool() {
+    let mut pool = POOL.lock();
+    while (POOL_SIZE.load(Ordering::Relaxed) as usize) < POOL_BUFFERS {
+        if !grow_pool(&mut pool) {
+            panic!("packet buffer pool alloc failed\n\x00");
+        }
+    }
+}
+
+/// Return the number of buffers in the pool, the number in use and the
+/// number of times the pool had to grow.
+pub fn pool_stats() -> (u32, u32, u32) {
+    (
+        POOL_SIZE.load(Ordering::Relaxed),
+        POOL_IN_USE.load(Ordering::Relaxed),
+        POOL_MISSES.load(Ordering::Relaxed),
+    )
+}
+
+/// Carve a new page into buffers on the shared list. Returns false if there
+/// is no memory.
+fn grow_pool(pool: &mut FreeList) -> bool {
+    let page = unsafe { kalloc() as *mut u8 };
+    if page.is_null() {
+        return false;
+    }
+    for offset in (0..PAGE_SIZE).step_by(BUFFER_SIZE) {
+        pool.push(unsafe { page.add(offset) });
+    }
+    POOL_SIZE.fetch_add((PAGE_SIZE / BUFFER_SIZE) as u32, Ordering::Relaxed);
+    true
+}
+
+/// Return the free buffer cache of the current CPU.
+fn cpu_cache() -> &'static Spinlock<FreeList> {
+    unsafe {
+        pushcli();
+        let cpu = cpuid() as usize;
+        popcli();
+        &CPU_CACHES[cpu]
+    }
+}
+
+/// Take a buffer from the cache of the current CPU, refilling the cache from
+/// the shared list if it is empty.
+fn pool_alloc() -> *mut u8 {
+    let mut cache = cpu_cache().lock();
+    if cache.len() == 0 {
+        let mut pool = POOL.lock();
+        if pool.len() == 0 {
+            POOL_MISSES.fetch_add(1, Ordering::Relaxed);
+            if !grow_pool(&mut pool) {
+                panic!("packet buffer alloc failed\n\x00");
+            }
         }
+        while cache.len() < CPU_CACHE_BATCH {
+            match pool.pop() {
+                Some(x) => cache.push(x),
+                None => break,
+            }
+        }
+    }
+    POOL_IN_USE.fetch_add(1, Ordering::Relaxed);
+    match cache.pop() {
+        Some(x) => x,
+        None => panic!("packet buffer alloc failed\n\x00"),
     }
 }
 
+/// Return a buffer to the cache of the current CPU, draining the cache to
+/// the shared list if it is full.
+fn pool_release(buf: *mut u8) {
+    let mut cache = cpu_cache().lock();
+    cache.push(buf);
+    if cache.len() > CPU_CACHE_MAX {
+        let mut pool = POOL.lock();
+        for _ in 0..CPU_CACHE_BATCH {
+            match cache.pop() {
+                Some(x) => pool.push(x),
+                None => break,
+            }
+        }
+    }
+    POOL_IN_USE.fetch_sub(1, Ordering::Relaxed);
+}
+
+/// An iterator over the unparsed bytes of a buffer chain.
+pub struct Segments<'a> {
+    segment: Option<&'a PacketBuffer>,
+}
+
+impl<'a> Iterator for Segments<'a> {
+    type Item = &'a [u8];
+
+    fn next(&mut self) -> Option<&'a [u8]> {
+        let segment = self.segment?;
+        let data = &segment.bytes()[segment.offset.get()..segment.size];
+        self.segment = segment.next.as_deref();
+        Some(data)
+    }
+}
+
+// Loaned memory is owned by the buffer until it is dropped, so the buffer can
+// be handed between CPUs, for example when queued on a socket.
+unsafe impl Send for PacketBuffer {}
+
 /// Represents a type that can be parsed from a PacketBuffer.
-pub trait FromBuffer {
+///
+/// Types may borrow the bytes they are parsed from for `'a`, as views with
+/// accessors that read the fields in place.
+pub trait FromBuffer<'a> {
     /// Parse a new instance from a slice of bytes.
-    fn from_buffer(buf: &[u8]) -> Result<Self, ()>
+    fn from_buffer(buf: &'a [u8]) -> Result<Self, ()>
     where
         Self: Sized;
 
@@ -89,6 +523,17 @@ pub trait FromBuffer {
     fn size(&self) -> usize;
 }
 
+/// Raw bytes, such as a packet payload, serialize as themselves.
+impl ToBuffer for [u8] {
+    fn to_buffer(&self, buf: &mut [u8]) {
+        buf.copy_from_slice(self);
+    }
+
+    fn size(&self) -> usize {
+        self.len()
+    }
+}
+
 /// Represents a type that can be serialized to a PacketBuffer.
 pub trait ToBuffer {
     /// Parse a new instance from a slice of bytes.
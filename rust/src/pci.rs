@@ -4,6 +4,29 @@ use crate::asm::{in_dw, out_dw};
 const PCI_CONFIG_ADDR: u16 = 0xCF8;
 const PCI_CONFIG_DATA: u16 = 0xCFC;
 
+/// The number of buses, devices per bus and functions per device.
+const BUSES: u32 = 256;
+const DEVICES: u32 = 32;
+const FUNCTIONS: u32 = 8;
+
+/// The vendor id read from a slot with no device.
+const NO_VENDOR: u16 = 0xFFFF;
+
+// Command register flags.
+const COMMAND_IO: u32 = 1 << 0; // Respond to I/O space accesses.
+const COMMAND_MEMORY: u32 = 1 << 1; // Respond to memory space accesses.
+const COMMAND_BUS_MASTER: u32 = 1 << 2; // Initiate DMA.
+const COMMAND_INTX_DISABLE: u32 = 1 << 10; // Do not assert the legacy interrupt.
+
+/// The MSI capability identifier.
+const CAP_MSI: u8 = 0x05;
+
+/// The MSI-X capability identifier.
+const CAP_MSIX: u8 = 0x11;
+
+/// The address local APICs accept message signalled interrupts at.
+const MSI_ADDRESS: u32 = 0xFEE00000;
+
 /// Represents a PCI configuration space header.
 pub struct PciConfig {
     base_addr: u32,
@@ -21,30 +44,75 @@ pub struct PciConfig {
 }
 
 impl PciConfig {
-    /// Read a new PciConfig struct from a memory mapped I/O address.
-    pub fn new(base_addr: u32) -> Result<PciConfig, ()> {
+    /// Read the configuration header of function `function` of device
+    /// `device` on bus `bus`. Returns None if there is no such function.
+    pub fn new(bus: u32, device: u32, function: u32) -> Option<PciConfig> {
+        let base_addr = 0x80000000 | bus << 16 | device << 11 | function << 8;
         unsafe {
-            let vendor_id = Self::read_vendor_id(base_addr);
-            let device_id = Self::read_device_id(base_addr);
-            let bar_0 = Self::read_bar(base_addr, 0);
+            let id = Self::read(base_addr, 0x00);
+            if id as u16 == NO_VENDOR {
+                return None;
+            }
+            let command = Self::read(base_addr, 0x04);
+            let class = Self::read(base_addr, 0x08);
+            let header = Self::read(base_addr, 0x0C);
+
+            // General devices have six BARs, PCI to PCI bridges two and
+            // CardBus bridges none.
+            let header_type = (header >> 16) as u8;
+            let bars = match header_type & 0x7F {
+                0x00 => 6,
+                0x01 => 2,
+                _ => 0,
+            };
+            let mut bar = [0u32; 6];
+            for (i, x) in bar.iter_mut().enumerate().take(bars) {
+                *x = Self::read(base_addr, 0x10 + 4 * i as u8);
+            }
 
-            Ok(PciConfig {
+            Some(PciConfig {
                 base_addr: base_addr,
-                vendor_id: vendor_id,
-                device_id: device_id,
-                command: 0,
-                status: 0,
-                revision_id: 0,
-                class_code: [0u8; 3],
-                cache_line_size: 0,
-                lat_timer: 0,
-                header_type: 0,
-                bist: 0,
-                bar: [bar_0, 0, 0, 0, 0, 0],
+                vendor_id: id as u16,
+                device_id: (id >> 16) as u16,
+                command: command as u16,
+                status: (command >> 16) as u16,
+                revision_id: class as u8,
+                class_code: [(class >> 8) as u8, (class >> 16) as u8, (class >> 24) as u8],
+                cache_line_size: header as u8,
+                lat_timer: (header >> 8) as u8,
+                header_type: header_type,
+                bist: (header >> 24) as u8,
+                bar: bar,
             })
         }
     }
 
+    /// Return an iterator over every function of every device on every bus.
+    ///
+    /// Every bus number is probed rather than following the bridges, which
+    /// finds devices however the firmware numbered the buses. Functions other
+    /// than the first are only probed on multi-function devices, as some
+    /// single function devices answer for all eight.
+    pub fn devices() -> impl Iterator<Item = PciConfig> {
+        (0..BUSES * DEVICES).flat_map(|slot| {
+            let (bus, device) = (slot / DEVICES, slot % DEVICES);
+            let first = PciConfig::new(bus, device, 0);
+            let multi_function = match first {
+                Some(ref x) => x.header_type & 0x80 != 0,
+                None => false,
+            };
+            let rest = (1..FUNCTIONS)
+                .take_while(move |_| multi_function)
+                .filter_map(move |function| PciConfig::new(bus, device, function));
+            first.into_iter().chain(rest)
+        })
+    }
+
+    /// Find the first device with the given vendor and device ids.
+    pub fn find(vendor_id: u16, device_id: u16) -> Option<PciConfig> {
+        PciConfig::devices().find(|x| x.vendor_id() == vendor_id && x.device_id() == device_id)
+    }
+
     /// Return the vendor id associated with the device.
     pub fn vendor_id(&self) -> u16 {
         self.vendor_id
@@ -60,57 +128,167 @@ impl PciConfig {
         self.bar[i as usize]
     }
 
-    /// Set the device as a bus master.
-    pub unsafe fn set_bus_master(&self) {
-        let mut command: u32 = 0x0;
-        let mut j = 1;
-        for i in (4..=5).rev() {
-            out_dw(PCI_CONFIG_ADDR, self.base_addr | i);
-            let data = in_dw(PCI_CONFIG_DATA);
-            command |= data << (j * 8);
-            j -= 1;
+    /// Return the size in bytes of the region decoded by the ith base address
+    /// register, or zero if it is unused.
+    ///
+    /// The size is found by writing all ones to the register and reading
+    /// back which address bits the device lets be set. Decoding is turned off
+    /// while the register holds the probe value. Only the low half of a 64
+    /// bit memory BAR is sized.
+    pub unsafe fn bar_size(&self, i: u8) -> u32 {
+        let offset = 0x10 + 4 * i;
+        let bar = self.bar(i);
+        let mask = match bar & 1 {
+            0 => !0xF, // Memory space.
+            _ => !0x3, // I/O space.
+        };
+
+        let command = self.read_config(0x04) & 0xFFFF;
+        self.write_config(0x04, command & !(COMMAND_IO | COMMAND_MEMORY));
+        self.write_config(offset, 0xFFFFFFFF);
+        let probe = self.read_config(offset);
+        self.write_config(offset, bar);
+        self.write_config(0x04, command);
+
+        let mut decoded = probe & mask;
+        if bar & 1 != 0 {
+            // The upper half of I/O BARs may read back as zero.
+            decoded |= 0xFFFF0000;
         }
+        match decoded {
+            0 => 0,
+            x => (!x).wrapping_add(1),
+        }
+    }
 
-        // Set the bus master flag and write back the command register.
-        command |= 1 << 2;
-        out_dw(PCI_CONFIG_ADDR, self.base_addr | 4);
-        out_dw(PCI_CONFIG_DATA, command);
+    /// Read the configuration space dword at `offset`.
+    pub unsafe fn read_config(&self, offset: u8) -> u32 {
+        Self::read(self.base_addr, offset)
     }
 
-    /// Read a PCI vendor identifier.
-    unsafe fn read_vendor_id(base_addr: u32) -> u16 {
-        let mut result: u16 = 0x0;
-        for i in (0..=1).rev() {
-            out_dw(PCI_CONFIG_ADDR, base_addr | i);
-            let data = in_dw(PCI_CONFIG_DATA);
-            result |= (data as u16) << (i * 8);
-        }
-        result
+    /// Write the configuration space dword at `offset`.
+    pub unsafe fn write_config(&self, offset: u8, data: u32) {
+        out_dw(PCI_CONFIG_ADDR, self.base_addr | (offset & 0xFC) as u32);
+        out_dw(PCI_CONFIG_DATA, data);
     }
 
-    /// Read a PCI device identifier.
-    unsafe fn read_device_id(base_addr: u32) -> u16 {
-        let mut result: u16 = 0x0;
-        let mut j = 1;
-        for i in (2..=3).rev() {
-            out_dw(PCI_CONFIG_ADDR, base_addr | i);
-            let data = in_dw(PCI_CONFIG_DATA);
-            result |= (data as u16) << (j * 8);
-            j -= 1;
+    /// Return the configuration space offset of the capability `id`, or None
+    /// if the device does not have it.
+    pub fn capability(&self, id: u8) -> Option<u8> {
+        // Is there a capabilities list (status bit 4)?
+        if self.status & (1 << 4) == 0 {
+            return None;
         }
-        result
+
+        unsafe {
+            // Follow the list from the capabilities pointer, bounding the
+            // walk in case the list is malformed.
+            let mut offset = self.read_config(0x34) as u8 & 0xFC;
+            for _ in 0..48 {
+                if offset == 0 {
+                    break;
+                }
+                let header = self.read_config(offset);
+                if header as u8 == id {
+                    return Some(offset);
+                }
+                offset = (header >> 8) as u8 & 0xFC;
+            }
+        }
+        None
+    }
+
+    /// Enable MSI with a single message, raising `vector` on the CPU with
+    /// local APIC ID `apic_id`.
+    ///
+    /// The legacy interrupt is disabled, so the device no longer shares an
+    /// interrupt line. Fails if the device has no MSI capability.
+    pub unsafe fn enable_msi(&self, apic_id: u8, vector: u8) -> Result<(), ()> {
+        let cap = self.capability(CAP_MSI).ok_or(())?;
+        let control = self.read_config(cap);
+
+        // The message data follows the upper address dword if the device
+        // supports 64 bit addresses (bit 7 of the message control word).
+        self.write_config(cap + 4, MSI_ADDRESS | (apic_id as u32) << 12);
+        let data = match control & (1 << 23) {
+            0 => cap + 8,
+            _ => {
+                self.write_config(cap + 8, 0);
+                cap + 12
+            }
+        };
+        self.write_config(data, vector as u32);
+
+        // Set MSI enable with one message enabled (MME = 0) in the message
+        // control word, the upper half of the capability header.
+        self.write_config(cap, (control & !(7 << 20)) | 1 << 16);
+        self.disable_intx();
+        Ok(())
     }
 
-    /// Read the nth BAR register.
-    unsafe fn read_bar(base_addr: u32, _n: u32) -> u32 {
-        let mut result: u32 = 0x0;
-        let mut j = 3;
-        for i in (16..=19).rev() {
-            out_dw(PCI_CONFIG_ADDR, base_addr | i);
-            let data = in_dw(PCI_CONFIG_DATA);
-            result |= data << (j * 8);
-            j -= 1;
+    /// Enable MSI-X, with table entry `i` raising `vectors[i].1` on the CPU
+    /// with local APIC ID `vectors[i].0`.
+    ///
+    /// Fails if the device has no MSI-X capability, too few table entries or
+    /// its table is not memory mapped within its BAR. The table must lie in
+    /// memory the kernel maps.
+    pub unsafe fn enable_msix(&self, vectors: &[(u8, u8)]) -> Result<(), ()> {
+        let cap = self.capability(CAP_MSIX).ok_or(())?;
+        let control = self.read_config(cap);
+        let table_size = (control >> 16 & 0x7FF) as usize + 1;
+        if vectors.len() > table_size {
+            return Err(());
+        }
+
+        // The table lives in the BAR given by the low bits of the table
+        // offset register.
+        let table = self.read_config(cap + 4);
+        let bar = self.bar((table & 7) as u8);
+        if bar & 1 != 0 {
+            return Err(());
+        }
+        let end = (table & !7) as usize + 16 * vectors.len();
+        if end > self.bar_size((table & 7) as u8) as usize {
+            return Err(());
+        }
+        let base = (bar & !0xF) + (table & !7);
+
+        // Each entry is the message address, upper address, data and vector
+        // control, which is written last to unmask the entry.
+        for (i, (apic_id, vector)) in vectors.iter().enumerate() {
+            let entry = (base + 16 * i as u32) as *mut u32;
+            core::ptr::write_volatile(entry, MSI_ADDRESS | (*apic_id as u32) << 12);
+            core::ptr::write_volatile(entry.add(1), 0);
+            core::ptr::write_volatile(entry.add(2), *vector as u32);
+            core::ptr::write_volatile(entry.add(3), 0);
         }
-        result
+
+        // Set MSI-X enable and clear function mask in the message control
+        // word, the upper half of the capability header.
+        self.write_config(cap, (control | 1 << 31) & !(1 << 30));
+        self.disable_intx();
+        Ok(())
+    }
+
+    /// Set the device as a bus master.
+    pub unsafe fn set_bus_master(&self) {
+        // The status register in the upper half is written as zero, which
+        // leaves its write one to clear bits alone.
+        let command = self.read_config(0x04) & 0xFFFF;
+        self.write_config(0x04, command | COMMAND_BUS_MASTER);
+    }
+
+    /// Stop the device asserting its legacy interrupt line, once it signals
+    /// interrupts by message.
+    unsafe fn disable_intx(&self) {
+        let command = self.read_config(0x04) & 0xFFFF;
+        self.write_config(0x04, command | COMMAND_INTX_DISABLE);
+    }
+
+    /// Read the configuration space dword at `offset` of the function at
+    /// `base_addr`.
+    unsafe fn read(base_addr: u32, offset: u8) -> u32 {
+        out_dw(PCI_CONFIG_ADDR, base_addr | (offset & 0xFC) as u32);
+        in_dw(PCI_CONFIG_DATA)
     }
 }
@@ -1,5 +1,6 @@
 use alloc::vec::Vec;
 
+use crate::ip::{checksum_add, checksum_fold, pseudo_header_sum, Checksum, Ipv4Addr, Protocol};
 use crate::packet_buffer::{FromBuffer, ToBuffer};
 
 /// Represents a UDP packet header.
@@ -23,44 +24,117 @@ impl UdpPacket {
         }
     }
 
-    fn from_slice(buf: &[u8]) -> Result<UdpPacket, ()> {
+    /// Create a header only packet for `data_len` bytes of data that is
+    /// written to the wire separately.
+    pub fn new_header(source_port: u16, dest_port: u16, data_len: u16) -> Self {
+        UdpPacket {
+            source_port: source_port,
+            dest_port: dest_port,
+            len: data_len + 8,
+            checksum: 0,
+            data: Vec::new(),
+        }
+    }
+
+    /// Set the checksum to the sum of the pseudo-header only, for the device
+    /// to complete over the header and data when the packet is sent.
+    pub fn set_pseudo_header_checksum(&mut self, source: Ipv4Addr, dest: Ipv4Addr) {
+        self.checksum = checksum_fold(pseudo_header_sum(source, dest, Protocol::UDP, self.len));
+    }
+
+    /// Set the checksum computed over the pseudo-header, the header and
+    /// `data`.
+    pub fn set_checksum(&mut self, source: Ipv4Addr, dest: Ipv4Addr, data: &[u8]) {
+        let mut header = [0u8; 8];
+        self.checksum = 0;
+        self.to_buffer(&mut header);
+
+        let mut sum = pseudo_header_sum(source, dest, Protocol::UDP, self.len);
+        sum = checksum_add(sum, &header);
+        sum = checksum_add(sum, data);
+
+        // A zero checksum means none was computed, so send all ones instead.
+        self.checksum = match !checksum_fold(sum) {
+            0 => 0xffff,
+            x => x,
+        };
+    }
+}
+
+/// A view of a received UDP header, read in place from the packet.
+///
+/// The data is left in the buffer, as it may span more than one buffer of a
+/// received packet.
+#[derive(Debug, Copy, Clone)]
+pub struct UdpView<'a> {
+    header: &'a [u8],
+}
+
+impl<'a> UdpView<'a> {
+    /// View the UDP header at the start of `buf`.
+    pub fn new(buf: &'a [u8]) -> Result<UdpView<'a>, ()> {
         if buf.len() < 8 {
             // This can't be a valid UDP packet.
             return Err(());
         }
-
-        let source_port = u16::from_be_bytes([buf[0], buf[1]]);
-        let dest_port = u16::from_be_bytes([buf[2], buf[3]]);
-        let len = u16::from_be_bytes([buf[4], buf[5]]);
-        let checksum = u16::from_be_bytes([buf[6], buf[7]]);
-        let data_len = (len - 8) as usize;
-        let data = buf[8..(8 + data_len)].to_vec();
-
-        Ok(UdpPacket {
-            source_port,
-            dest_port,
-            len,
-            checksum,
-            data,
-        })
+        let view = UdpView { header: &buf[..8] };
+        if view.len() < 8 {
+            return Err(());
+        }
+        Ok(view)
     }
 
     pub fn dest_port(&self) -> u16 {
-        return self.dest_port;
+        u16::from_be_bytes([self.header[2], self.header[3]])
+    }
+
+    /// The length of the header and data.
+    pub fn len(&self) -> u16 {
+        u16::from_be_bytes([self.header[4], self.header[5]])
+    }
+
+    pub fn checksum(&self) -> u16 {
+        u16::from_be_bytes([self.header[6], self.header[7]])
     }
 
-    pub fn data(&self) -> &[u8] {
-        return &self.data[..];
+    /// The length of the data following the header.
+    pub fn data_len(&self) -> usize {
+        (self.len() - 8) as usize
+    }
+
+    /// Check the checksum of a received packet against `data`, the pieces
+    /// of the data following the header. A zero checksum was not computed by
+    /// the sender and is always accepted.
+    pub fn checksum_valid<'b>(
+        &self,
+        source: Ipv4Addr,
+        dest: Ipv4Addr,
+        data: impl Iterator<Item = &'b [u8]>,
+    ) -> bool {
+        if self.checksum() == 0 {
+            return true;
+        }
+
+        let mut checksum =
+            Checksum::new(pseudo_header_sum(source, dest, Protocol::UDP, self.len()));
+        checksum.add(self.header);
+        let mut remaining = self.data_len();
+        for piece in data {
+            let n = core::cmp::min(piece.len(), remaining);
+            checksum.add(&piece[..n]);
+            remaining -= n;
+        }
+        remaining == 0 && checksum.valid()
     }
 }
 
-impl FromBuffer for UdpPacket {
-    fn from_buffer(buf: &[u8]) -> Result<UdpPacket, ()> {
-        UdpPacket::from_slice(&buf)
+impl<'a> FromBuffer<'a> for UdpView<'a> {
+    fn from_buffer(buf: &'a [u8]) -> Result<UdpView<'a>, ()> {
+        UdpView::new(buf)
     }
 
     fn size(&self) -> usize {
-        8 + self.data.len()
+        8
     }
 }
 
@@ -0,0 +1,864 @@
+use alloc::vec::Vec;
+use core::sync::atomic::{fence, Ordering};
+
+use crate::asm::{in_b, in_dw, in_w, out_b, out_dw, out_w};
+use crate::cpu::{rdtsc, CPU_FREQ_MHZ};
+use crate::e1000::{rx_half_alloc, rx_half_release, RX_HALF_SIZE};
+use crate::ethernet::{EthernetAddress, DEFAULT_MTU, HEADER_LEN, MAX_MTU, MIN_MTU};
+use crate::kernel::{cpuapicid, ioapicenable, kalloc};
+use crate::mm::{ContiguousArray, PhysicalAddress, PAGE_SIZE};
+use crate::net::{
+    DeviceParameter, DeviceStats, InterruptStatus, NetworkDevice, Offload, TxError, TxFragment,
+};
+use crate::packet_buffer::{ChecksumStatus, PacketBuffer, RxChecksum};
+use crate::pci::PciConfig;
+
+const IRQ_PIC0: u32 = 0xB;
+
+/// The interrupt vector raised by the MSI-X message, the vector of the legacy
+/// interrupt (T_IRQ0 + IRQ_PCI0 in traps.h) so it reaches netintr().
+const MSI_VECTOR: u8 = 32 + IRQ_PIC0 as u8;
+
+// The MSI-X vector registers, which take the place of the device
+// configuration while MSI-X is enabled, moving it four bytes on.
+const MSI_CONFIG_VECTOR: u16 = 0x14;
+const MSI_QUEUE_VECTOR: u16 = 0x16;
+
+/// The MSI-X vector number meaning no vector.
+const NO_VECTOR: u16 = 0xFFFF;
+
+/// How long to wait, in microseconds, for the device to return the frames in
+/// flight before giving up on it as stalled.
+const TX_DRAIN_TIMEOUT_US: u64 = 100_000;
+
+// Device identifiers.
+const VENDOR_ID: u16 = 0x1AF4; // Red Hat.
+const DEVICE_ID: u16 = 0x1000; // Transitional virtio network device.
+
+/// The receive and transmit queues.
+const RX_QUEUE: u16 = 0;
+const TX_QUEUE: u16 = 1;
+
+// Legacy virtio device registers, as offsets into the I/O space.
+enum DeviceRegister {
+    DeviceFeatures = 0x00,
+    GuestFeatures = 0x04,
+    QueueAddress = 0x08,
+    QueueSize = 0x0C,
+    QueueSelect = 0x0E,
+    QueueNotify = 0x10,
+    DeviceStatus = 0x12,
+    IsrStatus = 0x13,
+    Mac = 0x14,
+}
+
+// Device status flags.
+const STATUS_ACKNOWLEDGE: u8 = 1 << 0;
+const STATUS_DRIVER: u8 = 1 << 1;
+const STATUS_DRIVER_OK: u8 = 1 << 2;
+
+// Feature bits.
+const F_CSUM: u32 = 1 << 0; // Device checksums partially checksummed frames.
+const F_GUEST_CSUM: u32 = 1 << 1; // Driver accepts partially checksummed frames.
+const F_MAC: u32 = 1 << 5; // Device has a MAC address.
+const F_MRG_RXBUF: u32 = 1 << 15; // Received frames may span several buffers.
+const F_EVENT_IDX: u32 = 1 << 29; // Interrupts and notifications use event indexes.
+
+// Descriptor flags.
+const DESC_F_NEXT: u16 = 1 << 0;
+const DESC_F_WRITE: u16 = 1 << 1;
+
+/// Available ring flag suppressing interrupts, without F_EVENT_IDX.
+const AVAIL_F_NO_INTERRUPT: u16 = 1 << 0;
+
+/// Used ring flag suppressing notifications, without F_EVENT_IDX.
+const USED_F_NO_NOTIFY: u16 = 1 << 0;
+
+// Network header flags.
+const HDR_F_NEEDS_CSUM: u8 = 1 << 0;
+const HDR_F_DATA_VALID: u8 = 1 << 1;
+
+/// A virtqueue descriptor.
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy)]
+struct VirtqDesc {
+    addr: PhysicalAddress,
+    len: u32,
+    flags: u16,
+    next: u16,
+}
+
+/// The header preceding every frame sent or received.
+///
+/// The `num_buffers` field is only present with F_MRG_RXBUF.
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy)]
+struct VirtioNetHdr {
+    flags: u8,
+    gso_type: u8,
+    hdr_len: u16,
+    gso_size: u16,
+    csum_start: u16,
+    csum_offset: u16,
+    num_buffers: u16,
+}
+
+/// A split virtqueue in the legacy layout.
+///
+/// The descriptor table and available ring share the first pages, and the
+/// used ring starts on the next page boundary.
+///
+/// Reference: Virtio 1.1 - Section 2.6.2
+struct Virtqueue {
+    /// The queue number.
+    index: u16,
+    /// The number of descriptors, set by the device.
+    size: u16,
+    /// The memory holding the descriptor table and rings.
+    mem: ContiguousArray<u8>,
+    /// The offset of the used ring in `mem`.
+    used_offset: usize,
+    /// Are interrupts and notifications suppressed with event indexes?
+    event_idx: bool,
+    /// The next free entry in the available ring.
+    avail_idx: u16,
+    /// The available index last published to the device.
+    avail_published: u16,
+    /// The next entry to be read from the used ring.
+    last_used: u16,
+    /// The first descriptor on the free list, threaded through `next`.
+    free_head: u16,
+    /// The number of descriptors on the free list.
+    num_free: u16,
+}
+
+impl Virtqueue {
+    /// Allocate a queue of `size` descriptors, all free.
+    fn new(index: u16, size: u16, event_idx: bool) -> Option<Virtqueue> {
+        let n = size as usize;
+        let used_offset = (16 * n + 6 + 2 * n).next_multiple_of(PAGE_SIZE);
+        let len = used_offset + (6 + 8 * n).next_multiple_of(PAGE_SIZE);
+        let mut queue = Virtqueue {
+            index: index,
+            size: size,
+            mem: ContiguousArray::new(len)?,
+            used_offset: used_offset,
+            event_idx: event_idx,
+            avail_idx: 0,
+            avail_published: 0,
+            last_used: 0,
+            free_head: 0,
+            num_free: size,
+        };
+        for i in 0..size {
+            queue.desc(i).next = i + 1;
+        }
+        Some(queue)
+    }
+
+    /// The page frame number of the queue, as written to the device.
+    fn pfn(&self) -> u32 {
+        (self.mem.physical_address().0 >> 12) as u32
+    }
+
+    fn desc(&mut self, i: u16) -> &mut VirtqDesc {
+        unsafe { &mut *(self.mem.as_mut_ptr() as *mut VirtqDesc).add(i as usize) }
+    }
+
+    /// Pointer to the `i`th 16 bit word of the available ring.
+    fn avail(&mut self, i: usize) -> *mut u16 {
+        let offset = 16 * self.size as usize + 2 * i;
+        unsafe { self.mem.as_mut_ptr().add(offset) as *mut u16 }
+    }
+
+    /// Pointer to the `i`th 16 bit word of the used ring.
+    fn used(&mut self, i: usize) -> *mut u16 {
+        unsafe { self.mem.as_mut_ptr().add(self.used_offset + 2 * i) as *mut u16 }
+    }
+
+    /// Take a descriptor from the free list.
+    fn alloc_desc(&mut self) -> u16 {
+        let i = self.free_head;
+        self.free_head = self.desc(i).next;
+        self.num_free -= 1;
+        i
+    }
+
+    /// Empty both rings and return every descriptor to the free list. The
+    /// descriptors keep their buffers. Only valid while the device is reset.
+    fn reset(&mut self) {
+        let n = self.size as usize;
+        unsafe {
+            core::ptr::write_bytes(self.avail(0) as *mut u8, 0, 6 + 2 * n);
+            core::ptr::write_bytes(self.used(0) as *mut u8, 0, 6 + 8 * n);
+        }
+        self.avail_idx = 0;
+        self.avail_published = 0;
+        self.last_used = 0;
+        self.free_head = 0;
+        self.num_free = self.size;
+        for i in 0..self.size {
+            self.desc(i).next = i + 1;
+        }
+    }
+
+    /// Return the descriptor chain starting at `head` to the free list.
+    fn free_chain(&mut self, head: u16) {
+        let mut i = head;
+        let free_head = self.free_head;
+        loop {
+            self.num_free += 1;
+            let desc = self.desc(i);
+            if desc.flags & DESC_F_NEXT == 0 {
+                desc.next = free_head;
+                break;
+            }
+            i = desc.next;
+        }
+        self.free_head = head;
+    }
+
+    /// Add the descriptor chain starting at `head` to the available ring. The
+    /// device does not see it until the ring is published.
+    fn add(&mut self, head: u16) {
+        let slot = (self.avail_idx % self.size) as usize;
+        unsafe { self.avail(2 + slot).write_volatile(head) };
+        self.avail_idx = self.avail_idx.wrapping_add(1);
+    }
+
+    /// Publish the chains added to the available ring, notifying the device
+    /// if it has asked to be.
+    unsafe fn publish(&mut self, io_base: u16) {
+        let old = self.avail_published;
+        let new = self.avail_idx;
+        if old == new {
+            return;
+        }
+        fence(Ordering::Release);
+        self.avail(1).write_volatile(new);
+        self.avail_published = new;
+
+        // Read the device's event index or flags only once the new index is
+        // visible, or a notification could be missed.
+        fence(Ordering::SeqCst);
+        let notify = if self.event_idx {
+            let event = self.used(2 + 4 * self.size as usize).read_volatile();
+            new.wrapping_sub(event).wrapping_sub(1) < new.wrapping_sub(old)
+        } else {
+            self.used(0).read_volatile() & USED_F_NO_NOTIFY == 0
+        };
+        if notify {
+            out_w(io_base + DeviceRegister::QueueNotify as u16, self.index);
+        }
+    }
+
+    /// Has the device returned chains not yet read?
+    fn has_used(&mut self) -> bool {
+        let idx = unsafe { self.used(1).read_volatile() };
+        idx != self.last_used
+    }
+
+    /// Read the next chain returned by the device, returning the head
+    /// descriptor and the number of bytes the device wrote.
+    fn pop_used(&mut self) -> Option<(u16, u32)> {
+        if !self.has_used() {
+            return None;
+        }
+        fence(Ordering::Acquire);
+        let slot = (self.last_used % self.size) as usize;
+        let elem = self.used(2 + 4 * slot) as *const u32;
+        let (id, len) = unsafe { (elem.read_volatile(), elem.add(1).read_volatile()) };
+        self.last_used = self.last_used.wrapping_add(1);
+        Some((id as u16, len))
+    }
+
+    /// Ask the device not to interrupt when it returns chains.
+    ///
+    /// With event indexes, the index the device interrupts at is left behind
+    /// the chains already read, where the device will not reach it.
+    fn disable_interrupts(&mut self) {
+        unsafe {
+            if self.event_idx {
+                let event = self.last_used.wrapping_sub(1);
+                self.avail(2 + self.size as usize).write_volatile(event);
+            } else {
+                self.avail(0).write_volatile(AVAIL_F_NO_INTERRUPT);
+            }
+        }
+    }
+
+    /// Ask the device to interrupt when it next returns a chain.
+    ///
+    /// Returns true if chains were returned before the device could see the
+    /// request, which do not raise an interrupt.
+    fn enable_interrupts(&mut self) -> bool {
+        unsafe {
+            if self.event_idx {
+                let event = self.last_used;
+                self.avail(2 + self.size as usize).write_volatile(event);
+            } else {
+                self.avail(0).write_volatile(0);
+            }
+        }
+        fence(Ordering::SeqCst);
+        self.has_used()
+    }
+}
+
+/// Release a receive buffer loaned out in a PacketBuffer. The frame in the
+/// first buffer of a chain starts after the network header, so round the
+/// pointer back down to the start of the buffer.
+fn rx_buffer_release(ptr: *mut u8) {
+    rx_half_release((ptr as usize & !(RX_HALF_SIZE - 1)) as *mut u8)
+}
+
+/// A representation of the virtio network device state.
+pub struct VirtioNet {
+    /// Base address of the I/O port space of the device.
+    io_base: u16,
+
+    /// The hardware (MAC) address of the device.
+    hardware_address: Option<EthernetAddress>,
+
+    /// The features negotiated with the device.
+    features: u32,
+
+    /// The length of the network header, which depends on the features.
+    hdr_len: usize,
+
+    /// The receive queue. Every descriptor holds a half page buffer.
+    rx: Virtqueue,
+
+    /// The transmit queue.
+    tx: Virtqueue,
+
+    /// The transmit buffer owned by each transmit descriptor.
+    tx_bufs: Vec<*mut u8>,
+
+    /// The network header of each transmit descriptor that heads a frame.
+    tx_hdrs: ContiguousArray<VirtioNetHdr>,
+
+    /// The largest frame payload sent or received.
+    mtu: u32,
+
+    /// Are interrupts signalled by MSI-X message?
+    msix: bool,
+
+    /// Statistics counted by the driver, as the device keeps none.
+    stats: DeviceStats,
+}
+
+// The transmit buffers are owned by the driver.
+unsafe impl Send for VirtioNet {}
+unsafe impl Sync for VirtioNet {}
+
+impl VirtioNet {
+    /// Initialize a new driver instance for a virtio network device, through
+    /// the legacy interface of a transitional device.
+    ///
+    /// The legacy registers are held in the I/O space in the first BAR
+    /// register. Returns None if `pci_config` is not such a device.
+    ///
+    /// Reference: Virtio 1.1 - Sections 3.1 and 4.1.5
+    pub unsafe fn new(pci_config: &PciConfig) -> Option<VirtioNet> {
+        if pci_config.vendor_id() != VENDOR_ID || pci_config.device_id() != DEVICE_ID {
+            return None;
+        }
+        pci_config.set_bus_master();
+        let io_base = (pci_config.bar(0) & !0x3) as u16;
+
+        // Reset the device and tell it we have a driver.
+        out_b(io_base + DeviceRegister::DeviceStatus as u16, 0);
+        let mut status = STATUS_ACKNOWLEDGE | STATUS_DRIVER;
+        out_b(io_base + DeviceRegister::DeviceStatus as u16, status);
+
+        let offered = in_dw(io_base + DeviceRegister::DeviceFeatures as u16);
+        if offered & F_MAC == 0 {
+            return None;
+        }
+        let features = offered & (F_CSUM | F_GUEST_CSUM | F_MAC | F_MRG_RXBUF | F_EVENT_IDX);
+        out_dw(io_base + DeviceRegister::GuestFeatures as u16, features);
+        let event_idx = features & F_EVENT_IDX != 0;
+
+        let mut hardware_address = [0u8; 6];
+        for (i, x) in hardware_address.iter_mut().enumerate() {
+            *x = in_b(io_base + DeviceRegister::Mac as u16 + i as u16);
+        }
+
+        // Set up the queues, whose sizes are fixed by the device.
+        let mut queues = [RX_QUEUE, TX_QUEUE].map(|index| {
+            out_w(io_base + DeviceRegister::QueueSelect as u16, index);
+            let size = in_w(io_base + DeviceRegister::QueueSize as u16);
+            if size == 0 {
+                return None;
+            }
+            let queue = Virtqueue::new(index, size, event_idx)?;
+            out_dw(io_base + DeviceRegister::QueueAddress as u16, queue.pfn());
+            Some(queue)
+        });
+        let (rx, tx) = match (queues[0].take(), queues[1].take()) {
+            (Some(rx), Some(tx)) => (rx, tx),
+            _ => panic!("virtio queue setup failed\n\x00"),
+        };
+
+        let tx_hdrs = match ContiguousArray::new(tx.size as usize) {
+            Some(x) => x,
+            None => panic!("virtio queue setup failed\n\x00"),
+        };
+        let mut virtio = VirtioNet {
+            io_base: io_base,
+            hardware_address: Some(EthernetAddress::from_slice(&hardware_address)),
+            features: features,
+            hdr_len: if features & F_MRG_RXBUF != 0 { 12 } else { 10 },
+            rx: rx,
+            tx: tx,
+            tx_bufs: Vec::new(),
+            tx_hdrs: tx_hdrs,
+            mtu: DEFAULT_MTU,
+            msix: false,
+            stats: DeviceStats::default(),
+        };
+
+        // Fill the receive queue with buffers.
+        for i in 0..virtio.rx.size {
+            let desc = virtio.rx.desc(i);
+            desc.addr = PhysicalAddress::from_virtual(rx_half_alloc() as u64);
+            desc.len = RX_HALF_SIZE as u32;
+            desc.flags = DESC_F_WRITE;
+            virtio.rx.add(i);
+        }
+        virtio.rx.num_free = 0;
+
+        // Allocate a transmit buffer for each descriptor.
+        for _ in 0..virtio.tx.size {
+            let buf = kalloc() as *mut u8;
+            if buf.is_null() {
+                panic!("virtio tx buffer alloc failed\n\x00");
+            }
+            virtio.tx_bufs.push(buf);
+        }
+
+        // Transmitted frames are reclaimed when more room is needed, so only
+        // ask for transmit interrupts when the queue fills up.
+        virtio.tx.disable_interrupts();
+
+        // Send both queues' interrupts as a single MSI-X message rather than
+        // on the shared legacy interrupt line, mapping the queues before the
+        // device can use them. Configuration changes are not interrupted for.
+        virtio.msix = virtio.enable_msix(pci_config);
+
+        status |= STATUS_DRIVER_OK;
+        out_b(io_base + DeviceRegister::DeviceStatus as u16, status);
+        virtio.rx.publish(io_base);
+
+        // TODO: Parse APICs tables to determine interrupts.
+        if !virtio.msix {
+            ioapicenable(IRQ_PIC0, 0);
+        }
+
+        Some(virtio)
+    }
+
+    /// Enable MSI-X, with every queue raising the first table entry. Returns
+    /// false if the device cannot interrupt by message.
+    unsafe fn enable_msix(&mut self, pci_config: &PciConfig) -> bool {
+        if pci_config
+            .enable_msix(&[(cpuapicid(0) as u8, MSI_VECTOR)])
+            .is_err()
+        {
+            return false;
+        }
+        out_w(self.io_base + MSI_CONFIG_VECTOR, NO_VECTOR);
+        for index in [RX_QUEUE, TX_QUEUE] {
+            out_w(self.io_base + DeviceRegister::QueueSelect as u16, index);
+            out_w(self.io_base + MSI_QUEUE_VECTOR, 0);
+            // The device reads back NO_VECTOR if it could not map the queue.
+            if in_w(self.io_base + MSI_QUEUE_VECTOR) == NO_VECTOR {
+                panic!("virtio msi-x setup failed\n\x00");
+            }
+        }
+        true
+    }
+
+    /// Reset the device and set it up again with the same queues and buffers.
+    ///
+    /// Legacy devices cannot reset a single queue, so this is how the device
+    /// is stopped from reading the memory of frames it has not returned. Every
+    /// frame in flight is dropped, as are received frames not yet read.
+    unsafe fn reset(&mut self) {
+        let io_base = self.io_base;
+        out_b(io_base + DeviceRegister::DeviceStatus as u16, 0);
+        let status = STATUS_ACKNOWLEDGE | STATUS_DRIVER;
+        out_b(io_base + DeviceRegister::DeviceStatus as u16, status);
+        out_dw(
+            io_base + DeviceRegister::GuestFeatures as u16,
+            self.features,
+        );
+
+        self.rx.reset();
+        self.tx.reset();
+        for queue in [&self.rx, &self.tx] {
+            out_w(io_base + DeviceRegister::QueueSelect as u16, queue.index);
+            out_dw(io_base + DeviceRegister::QueueAddress as u16, queue.pfn());
+            if self.msix {
+                out_w(io_base + MSI_QUEUE_VECTOR, 0);
+            }
+        }
+        if self.msix {
+            out_w(io_base + MSI_CONFIG_VECTOR, NO_VECTOR);
+        }
+
+        // Every receive descriptor still holds a buffer.
+        for i in 0..self.rx.size {
+            self.rx.add(i);
+        }
+        self.rx.num_free = 0;
+        self.tx.disable_interrupts();
+
+        out_b(
+            io_base + DeviceRegister::DeviceStatus as u16,
+            status | STATUS_DRIVER_OK,
+        );
+        self.rx.publish(io_base);
+    }
+
+    /// Wait for the device to return every frame in flight, for at most
+    /// TX_DRAIN_TIMEOUT_US. Returns false if it has not by then.
+    fn tx_drain(&mut self) -> bool {
+        let deadline = rdtsc() + TX_DRAIN_TIMEOUT_US * CPU_FREQ_MHZ;
+        loop {
+            self.tx_reclaim();
+            if self.tx.num_free == self.tx.size {
+                return true;
+            }
+            if rdtsc() > deadline {
+                return false;
+            }
+            core::hint::spin_loop();
+        }
+    }
+
+    /// Reclaim transmitted frames the device has finished with.
+    ///
+    /// Returns the number of frames reclaimed.
+    fn tx_reclaim(&mut self) -> u32 {
+        let mut n = 0;
+        while let Some((head, _)) = self.tx.pop_used() {
+            self.tx.free_chain(head);
+            n += 1;
+        }
+        n
+    }
+
+    /// Reclaim transmitted frames until `needed` descriptors are free.
+    ///
+    /// If there is not enough room, ask for an interrupt when the device next
+    /// completes a frame, so senders waiting for room are woken.
+    fn tx_reserve(&mut self, needed: usize) -> bool {
+        self.tx_reclaim();
+        if self.tx.num_free as usize >= needed {
+            return true;
+        }
+        if self.tx.enable_interrupts() {
+            self.tx_reclaim();
+        }
+        self.tx.num_free as usize >= needed
+    }
+
+    /// Start a frame with a descriptor holding its network header, returning
+    /// the head descriptor of the chain.
+    fn tx_begin(&mut self, buf: &PacketBuffer) -> u16 {
+        let head = self.tx.alloc_desc();
+        let mut hdr = VirtioNetHdr::default();
+        if let Some((start, field)) = buf.tx_checksum().and_then(|x| x.transport) {
+            hdr.flags = HDR_F_NEEDS_CSUM;
+            hdr.csum_start = start as u16;
+            hdr.csum_offset = (field - start) as u16;
+        }
+        self.tx_hdrs[head as usize] = hdr;
+
+        let addr = PhysicalAddress::from_virtual(&self.tx_hdrs[head as usize] as *const _ as u64);
+        let hdr_len = self.hdr_len as u32;
+        let desc = self.tx.desc(head);
+        desc.addr = addr;
+        desc.len = hdr_len;
+        desc.flags = 0;
+        head
+    }
+
+    /// Chain a descriptor for `len` bytes at `addr` after the descriptor
+    /// `last`, returning the new descriptor.
+    fn tx_link(&mut self, last: u16, addr: PhysicalAddress, len: usize) -> u16 {
+        let idx = self.tx.alloc_desc();
+        let desc = self.tx.desc(idx);
+        desc.addr = addr;
+        desc.len = len as u32;
+        desc.flags = 0;
+        let prev = self.tx.desc(last);
+        prev.flags |= DESC_F_NEXT;
+        prev.next = idx;
+        idx
+    }
+
+    /// Copy `data` into the transmit buffers of as many descriptors as are
+    /// needed to hold it, chained after the descriptor `last`.
+    ///
+    /// Returns the last descriptor used.
+    fn tx_link_copy(&mut self, last: u16, data: &[u8]) -> u16 {
+        let mut last = last;
+        for chunk in data.chunks(PAGE_SIZE) {
+            // Use the buffer of the descriptor tx_link() takes next.
+            let buf = self.tx_bufs[self.tx.free_head as usize];
+            unsafe { core::ptr::copy(chunk.as_ptr(), buf, chunk.len()) };
+            last = self.tx_link(last, PhysicalAddress::from_virtual(buf as u64), chunk.len());
+        }
+        last
+    }
+
+    /// Count a frame sent.
+    fn tx_count(&mut self, len: usize) {
+        self.stats.tx_packets += 1;
+        self.stats.tx_good_packets += 1;
+        self.stats.tx_bytes += len as u64;
+        self.stats.tx_good_bytes += len as u64;
+    }
+
+    /// Take the buffer from the receive descriptor `idx`, skipping `skip`
+    /// bytes of header, and hand the descriptor back to the device with a
+    /// spare buffer in its place.
+    ///
+    /// The descriptor is not returned to the device until the receive queue
+    /// is next published.
+    fn rx_take(&mut self, idx: u16, len: usize, skip: usize) -> PacketBuffer {
+        let desc = self.rx.desc(idx);
+        let buf = desc.addr.to_virtual().0 as *mut u8;
+        desc.addr = PhysicalAddress::from_virtual(rx_half_alloc() as u64);
+        self.rx.add(idx);
+
+        let len = len.max(skip);
+        unsafe { PacketBuffer::new_loaned(buf.add(skip), len - skip, rx_buffer_release) }
+    }
+}
+
+/// Implement the common network interface.
+impl NetworkDevice for VirtioNet {
+    fn hardware_address(&self) -> EthernetAddress {
+        match self.hardware_address {
+            Some(x) => x,
+            None => panic!("hardware address not set\n\x00"),
+        }
+    }
+
+    /// The device has a single receive and transmit queue pair on the legacy
+    /// interrupt.
+    fn queues(&self) -> usize {
+        1
+    }
+
+    /// Without the control queue the device receives every frame, and the
+    /// queue sizes are fixed by the device.
+    fn parameter(&self, param: DeviceParameter) -> Option<u32> {
+        match param {
+            DeviceParameter::Mtu => Some(self.mtu),
+            DeviceParameter::Promiscuous => Some(1),
+            DeviceParameter::RxRingSize => Some(self.rx.size as u32),
+            DeviceParameter::TxRingSize => Some(self.tx.size as u32),
+            _ => None,
+        }
+    }
+
+    fn set_parameter(&mut self, param: DeviceParameter, value: u32) -> Result<(), ()> {
+        match param {
+            DeviceParameter::Mtu => {
+                // Without mergeable buffers a frame must fit in one buffer.
+                let max = match self.features & F_MRG_RXBUF {
+                    0 => (RX_HALF_SIZE - self.hdr_len - HEADER_LEN) as u32,
+                    _ => MAX_MTU,
+                };
+                if value < MIN_MTU || value > max {
+                    return Err(());
+                }
+                self.mtu = value;
+                Ok(())
+            }
+            _ => Err(()),
+        }
+    }
+
+    /// Without the control queue the device receives all multicast frames.
+    fn join_multicast(&mut self, _addr: EthernetAddress) {}
+
+    fn leave_multicast(&mut self, _addr: EthernetAddress) {}
+
+    /// The device only inserts the transport checksum.
+    fn offload(&self) -> Offload {
+        Offload {
+            tx_ip_checksum: false,
+            tx_udp_checksum: self.features & F_CSUM != 0,
+        }
+    }
+
+    fn stats(&mut self) -> DeviceStats {
+        self.stats
+    }
+
+    /// Reading the ISR status register acknowledges the interrupt.
+    /// The device's MSI-X message raises the legacy interrupt vector, so
+    /// other vectors were raised by another device.
+    fn clear_interrupts(&mut self, vector: Option<usize>) -> InterruptStatus {
+        let mut status = InterruptStatus::default();
+        if vector.is_some() {
+            return status;
+        }
+        unsafe { in_b(self.io_base + DeviceRegister::IsrStatus as u16) };
+
+        if self.tx_reclaim() > 0 {
+            status.tx_done = true;
+            self.tx.disable_interrupts();
+        }
+        status.rx_queues = self.rx.has_used() as u32;
+        status
+    }
+
+    fn disable_rx_interrupts(&mut self, _queue: usize) {
+        self.rx.disable_interrupts();
+    }
+
+    /// Frames the device returned before it saw the request do not raise an
+    /// interrupt, so are reported to the caller.
+    fn enable_rx_interrupts(&mut self, _queue: usize) -> bool {
+        self.rx.enable_interrupts()
+    }
+
+    /// Send the contents of a PacketBuffer over the wire.
+    fn send(&mut self, buf: PacketBuffer) -> Result<(), TxError> {
+        self.send_gather(buf, &[])
+    }
+
+    /// Send a header and payload fragments over the wire as one frame.
+    ///
+    /// The frame is a chain of descriptors, starting with the network header.
+    /// Direct fragments are read by the device in place, so wait for the frame
+    /// to be returned, or dropped, before returning them.
+    fn send_gather(&mut self, header: PacketBuffer, payload: &[TxFragment]) -> Result<(), TxError> {
+        // Check the whole frame fits before queuing any of it.
+        let mut needed = 1 + header.len().div_ceil(PAGE_SIZE);
+        let mut len = header.len();
+        for fragment in payload {
+            needed += match fragment {
+                TxFragment::Copy(data) => data.len().div_ceil(PAGE_SIZE),
+                TxFragment::Direct(_, _) => 1,
+            };
+            len += fragment.len();
+        }
+        if !self.tx_reserve(needed) {
+            return Err(TxError::RingFull);
+        }
+
+        let head = self.tx_begin(&header);
+        let mut last = self.tx_link_copy(head, header.as_slice());
+        let mut direct = false;
+        for fragment in payload {
+            last = match fragment {
+                TxFragment::Copy(data) => self.tx_link_copy(last, data),
+                TxFragment::Direct(addr, len) => {
+                    direct = true;
+                    self.tx_link(last, *addr, *len)
+                }
+            };
+        }
+        self.tx.add(head);
+        unsafe { self.tx.publish(self.io_base) };
+        self.tx_count(len);
+
+        // Frames are returned in order, so wait for every frame in flight. If
+        // the device does not return them, as when it has stalled, reset it
+        // so the memory is not read after returning.
+        if direct && !self.tx_drain() {
+            unsafe { self.reset() };
+            return Err(TxError::Stalled);
+        }
+
+        Ok(())
+    }
+
+    /// Send a batch of frames, notifying the device once for the whole batch
+    /// rather than once per frame.
+    fn send_batch(&mut self, _queue: usize, bufs: &mut dyn Iterator<Item = PacketBuffer>) -> usize {
+        // A frame takes a header descriptor and a data descriptor for each
+        // page it spans. A frame is only taken from `bufs` once there is room
+        // for the largest the MTU allows, and a larger frame that does not fit
+        // is dropped.
+        let max_needed = 1 + (self.mtu as usize + HEADER_LEN).div_ceil(PAGE_SIZE);
+        let mut queued = 0;
+        while self.tx_reserve(max_needed) {
+            let buf = match bufs.next() {
+                Some(x) => x,
+                None => break,
+            };
+            if !self.tx_reserve(1 + buf.len().div_ceil(PAGE_SIZE)) {
+                break;
+            }
+            let head = self.tx_begin(&buf);
+            self.tx_link_copy(head, buf.as_slice());
+            self.tx.add(head);
+            self.tx_count(buf.len());
+            queued += 1;
+        }
+
+        if queued > 0 {
+            unsafe { self.tx.publish(self.io_base) };
+        }
+        queued
+    }
+
+    /// Read avaliable packets from the device.
+    ///
+    /// Frames are not copied. The buffers holding the frame are loaned to the
+    /// returned PacketBuffer and spare buffers take their place in the queue.
+    /// With mergeable buffers, the header of the first buffer says how many
+    /// buffers the frame spans.
+    fn recv(&mut self, _queue: usize) -> Option<PacketBuffer> {
+        loop {
+            let (head, len) = self.rx.pop_used()?;
+            let hdr = unsafe {
+                let buf = self.rx.desc(head).addr.to_virtual().0 as *const VirtioNetHdr;
+                buf.read_volatile()
+            };
+            let num_buffers = match self.features & F_MRG_RXBUF {
+                0 => 1,
+                _ => hdr.num_buffers.max(1),
+            };
+
+            let mut frame = self.rx_take(head, len as usize, self.hdr_len);
+            if hdr.flags & (HDR_F_NEEDS_CSUM | HDR_F_DATA_VALID) != 0 {
+                frame.set_rx_checksum(RxChecksum {
+                    ip: ChecksumStatus::Unchecked,
+                    transport: ChecksumStatus::Good,
+                });
+            }
+            for _ in 1..num_buffers {
+                // The device returns every buffer of a frame before updating
+                // the used index.
+                match self.rx.pop_used() {
+                    Some((idx, len)) => frame.append(self.rx_take(idx, len as usize, 0)),
+                    None => break,
+                }
+            }
+            unsafe { self.rx.publish(self.io_base) };
+
+            let size = frame.remaining();
+            self.stats.rx_packets += 1;
+            self.stats.rx_bytes += size as u64;
+
+            // Drop frames too large for the MTU.
+            if size > self.mtu as usize + HEADER_LEN {
+                self.stats.rx_oversize += 1;
+                continue;
+            }
+            self.stats.rx_good_packets += 1;
+            self.stats.rx_good_bytes += size as u64;
+            return Some(frame);
+        }
+    }
+}
@@ -0,0 +1,57 @@
+use core::cell::UnsafeCell;
+use core::ffi::c_void;
+
+use crate::kernel::{acquire, release, sleep, wakeup, CSpinlock};
+
+/// A channel that processes can sleep on until woken by an interrupt handler
+/// or another process.
+///
+/// Wraps the xv6 sleep(...) and wakeup(...) primitives together with the
+/// spinlock that prevents wakeups being lost between checking a condition and
+/// going to sleep.
+pub struct WaitChannel {
+    lock: UnsafeCell<CSpinlock>,
+}
+
+unsafe impl Sync for WaitChannel {}
+
+impl WaitChannel {
+    pub const fn new(name: &'static [u8]) -> Self {
+        WaitChannel {
+            lock: UnsafeCell::new(CSpinlock::new(name)),
+        }
+    }
+
+    /// Sleep until `cond` returns a value.
+    ///
+    /// `cond` is evaluated with the channel lock held, so a wakeup arriving
+    /// after it fails but before the process sleeps is not lost. It must not
+    /// return while holding any other lock.
+    pub fn wait_until<T>(&self, mut cond: impl FnMut() -> Option<T>) -> T {
+        unsafe {
+            acquire(self.lock.get());
+            loop {
+                if let Some(x) = cond() {
+                    release(self.lock.get());
+                    return x;
+                }
+                sleep(self.chan(), self.lock.get());
+            }
+        }
+    }
+
+    /// Wake all processes sleeping on the channel.
+    ///
+    /// Must not be called while holding a lock taken inside `wait_until`.
+    pub fn wake(&self) {
+        unsafe {
+            acquire(self.lock.get());
+            wakeup(self.chan());
+            release(self.lock.get());
+        }
+    }
+
+    fn chan(&self) -> *const c_void {
+        self as *const _ as *const c_void
+    }
+}
@@ -23,6 +23,16 @@ int fetchint(uint addr, int *ip) {
   return 0;
 }
 
+// Check that the size bytes at addr lie in the current process,
+// as argptr() does for pointer arguments.
+int fetchptr(uint addr, int size) {
+  struct proc *curproc = myproc();
+
+  if (size < 0 || addr >= curproc->sz || addr + size > curproc->sz)
+    return -1;
+  return 0;
+}
+
 // Fetch the nul-terminated string at addr from the current process.
 // Doesn't actually copy the string - just sets *pp to point at it.
 // Returns length of string, not including nul.
@@ -83,17 +93,23 @@ extern int sys_exit(void);
 extern int sys_fork(void);
 extern int sys_fstat(void);
 extern int sys_getpid(void);
+extern int sys_ifconfig(void);
 extern int sys_kill(void);
 extern int sys_link(void);
 extern int sys_listen(void);
 extern int sys_mkdir(void);
 extern int sys_mknod(void);
+extern int sys_netbench(void);
+extern int sys_netctl(void);
+extern int sys_netdevstat(void);
+extern int sys_netstat(void);
 extern int sys_open(void);
 extern int sys_pipe(void);
 extern int sys_read(void);
 extern int sys_recv(void);
 extern int sys_sbrk(void);
 extern int sys_send(void);
+extern int sys_sendmmsg(void);
 extern int sys_shutdown(void);
 extern int sys_sleep(void);
 extern int sys_socket(void);
@@ -119,6 +135,9 @@ static int (*syscalls[])(void) = {
     [SYS_listen] sys_listen, [SYS_connect] sys_connect,
     [SYS_accept] sys_accept, [SYS_send] sys_send,
     [SYS_recv] sys_recv,     [SYS_shutdown] sys_shutdown,
+    [SYS_netbench] sys_netbench, [SYS_sendmmsg] sys_sendmmsg,
+    [SYS_netctl] sys_netctl,     [SYS_netstat] sys_netstat,
+    [SYS_netdevstat] sys_netdevstat, [SYS_ifconfig] sys_ifconfig,
 };
 
 void syscall(void) {
@@ -28,3 +28,9 @@
 #define SYS_send 31
 #define SYS_recv 32
 #define SYS_shutdown 33
+#define SYS_netbench 34
+#define SYS_sendmmsg 35
+#define SYS_netctl 36
+#define SYS_netstat 37
+#define SYS_netdevstat 38
+#define SYS_ifconfig 39
@@ -9,6 +9,7 @@
 #include "spinlock.h"
 
 void netintr();
+void netintrvec(int);
 
 // Interrupt descriptor table (shared by all CPUs).
 struct gatedesc idt[256];
@@ -69,6 +70,12 @@ void trap(struct trapframe *tf) {
     netintr();
     lapiceoi();
     break;
+  case T_IRQ0 + IRQ_MSI0:
+  case T_IRQ0 + IRQ_MSI0 + 1:
+  case T_IRQ0 + IRQ_MSI0 + 2:
+    netintrvec(tf->trapno - T_IRQ0 - IRQ_MSI0);
+    lapiceoi();
+    break;
   case T_IRQ0 + 7:
   case T_IRQ0 + IRQ_SPURIOUS:
     cprintf("cpu%d: spurious interrupt at %x:%x\n", cpuid(), tf->cs, tf->eip);
@@ -35,4 +35,5 @@
 #define IRQ_PCI0 11
 #define IRQ_IDE 14
 #define IRQ_ERROR 19
+#define IRQ_MSI0 24 // First of the MSI-X vectors
 #define IRQ_SPURIOUS 31
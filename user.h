@@ -1,5 +1,9 @@
 struct stat;
 struct rtcdate;
+struct mmsg;
+struct netstat;
+struct netdevstat;
+struct ifconfig;
 
 // system calls
 int fork(void);
@@ -31,6 +35,12 @@ int accept();
 int send(int, const void *, int);
 int recv(int, const void *, int);
 int shutdown(int);
+int netbench(void);
+int sendmmsg(int, struct mmsg *, int);
+int netctl(int, int);
+int netstat(struct netstat *);
+int netdevstat(struct netdevstat *);
+int ifconfig(int, struct ifconfig *, int);
 
 // ulib.c
 int stat(const char *, struct stat *);
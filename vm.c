@@ -329,6 +329,20 @@ char *uva2ka(pde_t *pgdir, char *uva) {
   return (char *)P2V(PTE_ADDR(*pte));
 }
 
+// Map user virtual address uva in the current process to the kernel
+// address of the same byte, e.g. so a device can be pointed at user
+// memory. Returns 0 if uva is not a mapped user address.
+char *uva2kva(char *uva) {
+  struct proc *curproc = myproc();
+  char *ka;
+
+  if ((uint)uva >= curproc->sz)
+    return 0;
+  if ((ka = uva2ka(curproc->pgdir, (char *)PGROUNDDOWN((uint)uva))) == 0)
+    return 0;
+  return ka + ((uint)uva % PGSIZE);
+}
+
 // Copy len bytes from p to user address va in page table pgdir.
 // Most useful when pgdir is not the current page table.
 // uva2ka ensures this only works for PTE_U pages.